@@ -11,6 +11,34 @@
 #include <sys/stat.h>
 #include <filesystem>
 #include <iomanip>
+#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+#include <regex>
+#include <memory>
+#include <cctype>
+#include <string_view>
+
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#endif
 
 namespace fs = std::filesystem;
 
@@ -56,45 +84,306 @@ std::string simpleHash(const std::string& content) {
     return oss.str();
 }
 
-std::string getCurrentTimestamp() {
-    time_t now = time(NULL);
-    struct tm* t = localtime(&now);
-    char buf[64];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", t);
-    return std::string(buf);
+std::string extractField(const std::string& line) {
+    size_t colon = line.find(":");
+    if (colon == std::string::npos) return "";
+    return line.substr(colon + 2); // skip ": "
 }
 
-std::string readHEAD() {
-    std::ifstream head(".minigit\\HEAD");
-    std::string line;
-    getline(head, line);
+unsigned workerCount() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n == 0 ? 4 : n;
+}
+
+// Calls fn(i) for every i below `count` on up to workerCount() threads, each
+// taking the next index as soon as it finishes one. Returns the thread count.
+unsigned parallelFor(size_t count, const std::function<void(size_t)>& fn) {
+    unsigned threads = (unsigned)std::min<size_t>(workerCount(), std::max<size_t>(count, 1));
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < threads; ++w) {
+        workers.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++) fn(i);
+        });
+    }
+    for (auto& t : workers) t.join();
+    return threads;
+}
+
+std::string normalizePath(const std::string& path) {
+    std::string norm = fs::path(path).lexically_normal().generic_string();
+    if (norm.rfind("./", 0) == 0) norm = norm.substr(2);
+    return norm;
+}
+
+std::vector<std::string> splitPath(const std::string& path) {
+    std::vector<std::string> parts;
+    std::istringstream iss(normalizePath(path));
+    std::string part;
+    while (getline(iss, part, '/')) {
+        if (!part.empty() && part != ".") parts.push_back(part);
+    }
+    return parts;
+}
+
+std::string hashWorkingFile(const std::string& filename) {
+    std::ifstream file(filename.c_str());
+    if (!file) return "";
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    return simpleHash(buffer.str());
+}
+
+// ========== REFERENCE STORAGE ==========
+
+// Refs live either as loose files under refs/ or as "<name> <hash>" lines in
+// the sorted packed-refs file; a loose ref overrides a packed one. Every
+// update is a compare-and-swap: the new value is written to "<ref>.lock"
+// (created exclusively), the current value is checked against the expected
+// one, and the lock is renamed over the ref. Writers that lose the race see
+// REF_STALE and rebuild their update on top of the new value.
+
+enum RefUpdate { REF_UPDATED, REF_STALE, REF_LOCKED };
+
+const int REF_UPDATE_RETRIES = 50;
+
+// Read-only view of a whole file, memory-mapped where the platform allows.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        std::ifstream file(path.c_str(), std::ios::binary);
+        if (!file) return;
+        std::ostringstream buffer;
+        buffer << file.rdbuf();
+        contents = buffer.str();
+        data = contents.data();
+        size = contents.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                data = (const char*)map;
+                size = info.st_size;
+            }
+        }
+        ::close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data) munmap((void*)data, size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+#ifdef _WIN32
+private:
+    std::string contents;
+#endif
+};
+
+std::string refPath(const std::string& gitDir, const std::string& name) {
+    if (name == "HEAD") return gitDir + "\\HEAD";
+    return gitDir + "\\refs\\" + name;
+}
 
-    if (line.find("ref: ") == 0) {
-        std::ifstream ref(".minigit\\" + line.substr(5));
-        getline(ref, line);
+// Ref names are single file names under refs/; anything that could escape
+// that directory or collide with a lock file is refused.
+bool isValidRefName(const std::string& name) {
+    if (name.empty() || name == "HEAD" || name[0] == '.' || name.find("..") != std::string::npos)
+        return false;
+    if (name.find_first_of("/\\:*?\"<>| \t") != std::string::npos) return false;
+    return name.size() < 5 || name.substr(name.size() - 5) != ".lock";
+}
+
+std::string readRefFile(const std::string& path) {
+    std::ifstream file(path.c_str());
+    std::string value;
+    getline(file, value);
+    if (!value.empty() && value.back() == '\r') value.pop_back();
+    return value;
+}
+
+// Binary search over the sorted "<name> <hash>" lines of packed-refs.
+std::string lookupPackedRef(const std::string& gitDir, const std::string& name) {
+    MappedFile packed(gitDir + "\\packed-refs");
+    if (!packed.data) return "";
+
+    const char* begin = packed.data;
+    const char* end = packed.data + packed.size;
+    size_t lo = 0, hi = packed.size;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char* line = begin + mid;
+        while (line > begin && line[-1] != '\n') --line;
+
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        const char* space = (const char*)memchr(line, ' ', eol - line);
+        if (!space) return "";
+
+        int cmp = std::string(line, space).compare(name);
+        if (cmp == 0) {
+            // Files written in text mode on Windows end in CRLF.
+            const char* value = eol;
+            if (value > space + 1 && value[-1] == '\r') --value;
+            return std::string(space + 1, value);
+        }
+        if (cmp < 0) lo = (eol - begin) + 1;
+        else hi = line - begin;
+    }
+    return "";
+}
+
+std::string lookupRef(const std::string& name, const std::string& gitDir = ".minigit") {
+    if (name == "HEAD") return readRefFile(refPath(gitDir, name));
+    std::string loose = readRefFile(refPath(gitDir, name));
+    if (!loose.empty()) return loose;
+    return lookupPackedRef(gitDir, name);
+}
+
+RefUpdate updateRef(const std::string& name, const std::string& expected,
+                    const std::string& value, const std::string& gitDir = ".minigit") {
+    std::string path = refPath(gitDir, name);
+    std::string lockPath = path + ".lock";
+
+    FILE* lock = std::fopen(lockPath.c_str(), "wx");
+    if (!lock) return REF_LOCKED;
+    std::fputs(value.c_str(), lock);
+    bool written = std::fflush(lock) == 0;
+    std::fclose(lock);
+
+    if (!written || lookupRef(name, gitDir) != expected) {
+        std::remove(lockPath.c_str());
+        return written ? REF_STALE : REF_LOCKED;
+    }
+
+    std::error_code ec;
+    fs::rename(lockPath, path, ec);
+    if (ec) {
+        std::remove(lockPath.c_str());
+        return REF_LOCKED;
+    }
+    return REF_UPDATED;
+}
+
+// Like updateRef, but waits out other writers holding the lock.
+RefUpdate updateRefWithRetry(const std::string& name, const std::string& expected,
+                             const std::string& value, const std::string& gitDir = ".minigit") {
+    RefUpdate result = REF_LOCKED;
+    for (int attempt = 0; attempt < REF_UPDATE_RETRIES; ++attempt) {
+        result = updateRef(name, expected, value, gitDir);
+        if (result != REF_LOCKED) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1 + attempt));
     }
-    return line;
+    return result;
+}
+
+// Why an update loop gave up on a ref, for error messages.
+std::string refUpdateFailure(RefUpdate result) {
+    if (result == REF_STALE)
+        return "it kept moving under other writers (gave up after " +
+               std::to_string(REF_UPDATE_RETRIES) + " attempts)";
+    return "another writer holds its lock";
+}
+
+// Ref that a new commit should advance: the checked-out branch, or HEAD
+// itself when detached.
+std::string headTarget(const std::string& gitDir = ".minigit") {
+    std::string head = lookupRef("HEAD", gitDir);
+    if (head.find("ref: refs/") == 0) return head.substr(10);
+    return "HEAD";
+}
+
+std::string readHEAD(const std::string& gitDir = ".minigit") {
+    std::string target = headTarget(gitDir);
+    std::string hash = lookupRef(target, gitDir);
+    if (hash.find("ref: ") == 0) return "";
+    return hash;
 }
 
 std::string getParentCommitHash() {
-    std::ifstream head(".minigit\\HEAD");
-    std::string parent;
-    if (head >> parent)
-        return parent;
-    return "none";
+    std::string parent = readHEAD();
+    return parent.empty() ? "none" : parent;
 }
 
 std::string getBranchHash(const std::string& branch) {
-    std::ifstream file(".minigit\\refs\\" + branch);
-    std::string hash;
-    if (file >> hash) return hash;
-    return "";
+    return lookupRef(branch);
 }
 
-std::string extractField(const std::string& line) {
-    size_t colon = line.find(":");
-    if (colon == std::string::npos) return "";
-    return line.substr(colon + 2); // skip ": "
+// Moves HEAD (or the branch it points to) from `parent` to `commitHash`.
+RefUpdate advanceHEAD(const std::string& parent, const std::string& commitHash) {
+    std::string expected = parent == "none" ? "" : parent;
+    return updateRefWithRetry(headTarget(), expected, commitHash);
+}
+
+std::map<std::string, std::string> listLooseRefs(const std::string& gitDir) {
+    std::map<std::string, std::string> refs;
+    std::error_code ec;
+    for (fs::directory_iterator it(gitDir + "\\refs", ec), end; !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        if (!it->is_regular_file(ec) || (name.size() > 5 && name.substr(name.size() - 5) == ".lock"))
+            continue;
+        std::string hash = readRefFile(refPath(gitDir, name));
+        if (!hash.empty()) refs[name] = hash;
+    }
+    return refs;
+}
+
+// All refs of a repository, loose values overriding packed ones.
+std::map<std::string, std::string> listRefs(const std::string& gitDir) {
+    std::map<std::string, std::string> refs;
+    {
+        MappedFile packed(gitDir + "\\packed-refs");
+        std::istringstream lines(packed.data ? std::string(packed.data, packed.size) : "");
+        std::string name, hash;
+        while (lines >> name >> hash) refs[name] = hash;
+    }
+    for (auto& r : listLooseRefs(gitDir)) refs[r.first] = r.second;
+    return refs;
+}
+
+void packRefs() {
+    std::map<std::string, std::string> loose = listLooseRefs(".minigit");
+    std::map<std::string, std::string> refs = listRefs(".minigit");
+    std::error_code ec;
+
+    FILE* lock = std::fopen(".minigit\\packed-refs.lock", "wbx");
+    if (!lock) {
+        std::cerr << "? packed-refs is locked by another writer.\n";
+        return;
+    }
+    for (auto& r : refs) std::fprintf(lock, "%s %s\n", r.first.c_str(), r.second.c_str());
+    std::fclose(lock);
+    fs::rename(".minigit\\packed-refs.lock", ".minigit\\packed-refs", ec);
+    if (ec) {
+        std::remove(".minigit\\packed-refs.lock");
+        std::cerr << "? Failed to write packed-refs.\n";
+        return;
+    }
+
+    // Drop a loose ref only if nobody moved it while we were packing.
+    int pruned = 0;
+    for (auto& r : loose) {
+        std::string path = refPath(".minigit", r.first);
+        FILE* refLock = std::fopen((path + ".lock").c_str(), "wx");
+        if (!refLock) continue;
+        std::fclose(refLock);
+        if (readRefFile(path) == r.second && std::remove(path.c_str()) == 0) ++pruned;
+        std::remove((path + ".lock").c_str());
+    }
+
+    std::cout << "? Packed " << refs.size() << " ref(s), pruned " << pruned << " loose file(s).\n";
 }
 
 // ========== BLOB STORAGE ==========
@@ -163,68 +452,274 @@ void storeBlobAndStage(const std::string& filename) {
 // ========== BRANCH MANAGEMENT ==========
 
 void createPointer(const std::string& name) {
-    std::ifstream headFile(".minigit\\HEAD");
-    std::string hash;
+    if (!isValidRefName(name)) {
+        std::cerr << "? Invalid pointer name: " << name << "\n";
+        return;
+    }
+
+    std::string hash = readHEAD();
 
-    if (!(headFile >> hash)) {
+    if (hash.empty()) {
         std::cerr << "? No HEAD found.\n";
         return;
     }
 
     ensureRefsDirectory();
 
-    std::ofstream ref(".minigit\\refs\\" + name);
-    ref << hash;
-    ref.close();
+    if (updateRefWithRetry(name, lookupRef(name), hash) != REF_UPDATED) {
+        std::cerr << "? Pointer '" << name << "' was changed concurrently, not updated.\n";
+        return;
+    }
 
     std::cout << "? Pointer '" << name << "' created ? " << hash << "\n";
 }
 
 void createBranch(const std::string& branchName) {
-    std::ifstream head(".minigit\\HEAD");
-    std::string currentHash;
+    if (!isValidRefName(branchName)) {
+        std::cerr << "? Invalid branch name: " << branchName << "\n";
+        return;
+    }
 
-    if (!head || !(head >> currentHash)) {
+    std::string currentHash = readHEAD();
+
+    if (currentHash.empty()) {
         std::cerr << "? HEAD not found or unreadable.\n";
         return;
     }
 
     ensureRefsDirectory();
 
-    std::string path = ".minigit\\refs\\" + branchName;
-    std::ofstream branch(path.c_str());
-
-    if (!branch.is_open()) {
-        std::cerr << "? Failed to create branch file at: " << path << "\n";
+    RefUpdate result = updateRefWithRetry(branchName, lookupRef(branchName), currentHash);
+    if (result == REF_STALE) {
+        std::cerr << "? Branch '" << branchName << "' was changed concurrently, not updated.\n";
+        return;
+    }
+    if (result == REF_LOCKED) {
+        std::cerr << "? Failed to create branch file at: " << refPath(".minigit", branchName) << "\n";
         return;
     }
-
-    branch << currentHash;
-    branch.close();
 
     std::cout << "? Branch '" << branchName << "' created ? " << currentHash << "\n";
 }
 
 // ========== COMMIT MANAGEMENT ==========
 
-std::map<std::string, std::string> readBlobsFromCommit(const std::string& hash) {
-    std::map<std::string, std::string> blobs;
-    std::ifstream file(".minigit\\commits\\" + hash);
+// Commits are written in a versioned binary encoding: a fixed 64-byte header
+// (parent hashes, epoch timestamp, message location, entry count), a table of
+// fixed-size entries, then a pool holding the message and file names. History
+// walks read the header straight out of the mapped file without parsing any
+// text. Commits written before this format are plain "field: value" text and
+// are still read through the line parser. Integers are stored in host byte
+// order (little-endian on every platform MiniGit targets).
+
+const char COMMIT_MAGIC[4] = {'\0', 'M', 'G', 'C'};
+const uint32_t COMMIT_VERSION = 1;
+const size_t HASH_FIELD = 16;
+
+struct CommitHeader {
+    char magic[4];
+    uint32_t version;
+    int64_t timestamp;
+    uint32_t parentCount;
+    uint32_t entryCount;
+    uint32_t messageOffset;
+    uint32_t messageLength;
+    char parents[2][HASH_FIELD];    // NUL-padded hex hashes
+};
+
+struct CommitEntry {
+    uint32_t pathOffset;
+    uint32_t pathLength;
+    char blob[HASH_FIELD];
+};
+
+static_assert(sizeof(CommitHeader) == 64, "commit header layout");
+static_assert(sizeof(CommitEntry) == 24, "commit entry layout");
+
+struct CommitRecord {
+    std::string timestamp;
+    std::string message;
+    std::vector<std::string> parents;
+    std::vector<std::pair<std::string, std::string>> blobs;  // filename, blob hash
+};
+
+std::string formatTimestamp(time_t when) {
+    char buf[64];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    return std::string(buf);
+}
+
+bool isBinaryCommit(const char* data, size_t size) {
+    return size >= sizeof(COMMIT_MAGIC) && memcmp(data, COMMIT_MAGIC, sizeof(COMMIT_MAGIC)) == 0;
+}
+
+std::string hashField(const char* field) {
+    return std::string(field, strnlen(field, HASH_FIELD));
+}
+
+// Copies a hash into its zeroed fixed-width field; a full-width hash is
+// stored without a terminator.
+bool putHashField(char* field, const std::string& hash) {
+    if (hash.size() > HASH_FIELD) return false;
+    memcpy(field, hash.data(), std::min(hash.size(), HASH_FIELD));
+    return true;
+}
+
+// Returns "" if a parent or blob hash does not fit its field.
+std::string encodeCommit(time_t when, const std::string& message,
+                         const std::vector<std::string>& parents,
+                         const std::vector<std::pair<std::string, std::string>>& blobs) {
+    CommitHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMMIT_MAGIC, sizeof(COMMIT_MAGIC));
+    header.version = COMMIT_VERSION;
+    header.timestamp = (int64_t)when;
+
+    for (const auto& parent : parents) {
+        if (parent.empty() || parent == "none" || header.parentCount == 2) continue;
+        if (!putHashField(header.parents[header.parentCount++], parent)) return "";
+    }
+
+    // An empty blob hash marks a file the merge deleted; it gets no entry.
+    for (const auto& b : blobs)
+        if (!b.second.empty()) ++header.entryCount;
+
+    std::string pool = message;
+    header.messageOffset = (uint32_t)(sizeof(CommitHeader) + header.entryCount * sizeof(CommitEntry));
+    header.messageLength = (uint32_t)message.size();
+
+    std::string data((const char*)&header, sizeof(header));
+    for (const auto& b : blobs) {
+        if (b.second.empty()) continue;
+        CommitEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.pathOffset = (uint32_t)(header.messageOffset + pool.size());
+        entry.pathLength = (uint32_t)b.first.size();
+        if (!putHashField(entry.blob, b.second)) return "";
+        pool += b.first;
+        data.append((const char*)&entry, sizeof(entry));
+    }
+    return data + pool;
+}
+
+bool decodeBinaryCommit(const char* data, size_t size, CommitRecord& commit, bool withBlobs) {
+    CommitHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.version != COMMIT_VERSION || header.parentCount > 2 ||
+        (uint64_t)header.messageOffset + header.messageLength > size ||
+        sizeof(header) + (uint64_t)header.entryCount * sizeof(CommitEntry) > size)
+        return false;
+
+    commit.timestamp = formatTimestamp((time_t)header.timestamp);
+    commit.message.assign(data + header.messageOffset, header.messageLength);
+    for (uint32_t i = 0; i < header.parentCount; ++i)
+        commit.parents.push_back(hashField(header.parents[i]));
+
+    if (!withBlobs) return true;
+    const char* table = data + sizeof(header);
+    for (uint32_t i = 0; i < header.entryCount; ++i) {
+        CommitEntry entry;
+        memcpy(&entry, table + i * sizeof(CommitEntry), sizeof(entry));
+        if ((uint64_t)entry.pathOffset + entry.pathLength > size) return false;
+        commit.blobs.push_back({std::string(data + entry.pathOffset, entry.pathLength),
+                                hashField(entry.blob)});
+    }
+    return true;
+}
+
+bool parseTextCommit(const std::string& content, CommitRecord& commit, bool withBlobs) {
+    std::istringstream lines(content);
     std::string line;
     bool inBlobs = false;
 
-    while (getline(file, line)) {
+    // Commits written in text mode on Windows end their lines in CRLF.
+    while (getline(lines, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
         if (line == "blobs:") {
+            if (!withBlobs) break;
             inBlobs = true;
-            continue;
-        }
-        if (inBlobs && line.find("  ") == 0) {
+        } else if (inBlobs && line.find("  ") == 0) {
             std::istringstream iss(line);
-            std::string _, filename, blob;
-            iss >> _ >> filename >> blob;
-            blobs[filename] = blob;
+            std::string filename, blob;
+            if (iss >> filename >> blob) commit.blobs.push_back({filename, blob});
+        } else if (line.find("timestamp:") == 0) {
+            commit.timestamp = extractField(line);
+        } else if (line.find("message:") == 0) {
+            commit.message = extractField(line);
+        } else if (line.rfind("parent: ", 0) == 0) {
+            if (line.substr(8) != "none") commit.parents.push_back(line.substr(8));
+        } else if (line.rfind("parent2: ", 0) == 0) {
+            commit.parents.push_back(line.substr(9));
         }
     }
+    return true;
+}
+
+bool parseCommit(const char* data, size_t size, CommitRecord& commit, bool withBlobs) {
+    if (isBinaryCommit(data, size)) return decodeBinaryCommit(data, size, commit, withBlobs);
+    return parseTextCommit(std::string(data, size), commit, withBlobs);
+}
+
+bool readCommit(const std::string& hash, CommitRecord& commit, bool withBlobs,
+                const std::string& gitDir = ".minigit") {
+    MappedFile file(gitDir + "\\commits\\" + hash);
+    if (!file.data) return false;
+    return parseCommit(file.data, file.size, commit, withBlobs);
+}
+
+// Parent lookup for history walks; binary commits only touch the header.
+std::vector<std::string> readCommitParents(const std::string& hash, const std::string& gitDir = ".minigit") {
+    std::vector<std::string> parents;
+    MappedFile file(gitDir + "\\commits\\" + hash);
+    if (!file.data) return parents;
+
+    if (isBinaryCommit(file.data, file.size) && file.size >= sizeof(CommitHeader)) {
+        CommitHeader header;
+        memcpy(&header, file.data, sizeof(header));
+        for (uint32_t i = 0; i < header.parentCount && i < 2; ++i)
+            parents.push_back(hashField(header.parents[i]));
+        return parents;
+    }
+
+    CommitRecord commit;
+    parseTextCommit(std::string(file.data, file.size), commit, false);
+    return commit.parents;
+}
+
+// Object and text commit files go through text-mode streams like the rest of
+// the code; binary commits must be read and written byte for byte.
+std::string readStoredFile(const std::string& path) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    std::string content = buffer.str();
+#ifdef _WIN32
+    if (!isBinaryCommit(content.data(), content.size())) {
+        std::ifstream text(path.c_str());
+        std::ostringstream textBuffer;
+        textBuffer << text.rdbuf();
+        content = textBuffer.str();
+    }
+#endif
+    return content;
+}
+
+bool writeStoredFile(const std::string& path, const std::string& content) {
+    bool binary = isBinaryCommit(content.data(), content.size());
+    std::ofstream out(path.c_str(), binary ? std::ios::binary | std::ios::trunc : std::ios::trunc);
+    out << content;
+    out.close();
+    return !out.fail();
+}
+
+std::map<std::string, std::string> readBlobsFromCommit(const std::string& hash,
+                                                       const std::string& gitDir = ".minigit") {
+    std::map<std::string, std::string> blobs;
+    CommitRecord commit;
+    if (readCommit(hash, commit, true, gitDir)) {
+        for (auto& b : commit.blobs) blobs[b.first] = b.second;
+    }
     return blobs;
 }
 
@@ -245,35 +740,41 @@ void writeCommit(const std::string& message) {
         return;
     }
 
-    std::ostringstream content;
-    std::string line;
-
-    // Metadata
-    content << "timestamp: " << getCurrentTimestamp() << "\n";
-    content << "message: " << message << "\n";
-    content << "parent: " << getParentCommitHash() << "\n";
-    content << "blobs:\n";
-
     // File list from index
-    while (getline(index, line)) {
-        content << "  " << line << "\n";
+    std::vector<std::pair<std::string, std::string>> staged;
+    std::string filename, blob;
+    while (index >> filename >> blob) {
+        staged.push_back({filename, blob});
     }
     index.close();
 
-    // Generate commit hash
-    std::string commitData = content.str();
-    std::string commitHash = simpleHash(commitData);
+    time_t now = time(NULL);
+    std::string commitHash;
+    RefUpdate result = REF_STALE;
 
-    // Write to .minigit/commits/<hash>
-    std::string path = ".minigit\\commits\\" + commitHash;
-    std::ofstream out(path.c_str());
-    out << commitData;
-    out.close();
+    // Retry on top of whatever another writer committed in the meantime
+    for (int attempt = 0; attempt < REF_UPDATE_RETRIES && result == REF_STALE; ++attempt) {
+        std::string parent = getParentCommitHash();
 
-    // Update HEAD
-    std::ofstream head(".minigit\\HEAD");
-    head << commitHash;
-    head.close();
+        // Generate commit hash
+        std::string commitData = encodeCommit(now, message, {parent}, staged);
+        if (commitData.empty()) {
+            std::cerr << "? Malformed hash in index or HEAD, nothing committed.\n";
+            return;
+        }
+        commitHash = simpleHash(commitData);
+
+        // Write to .minigit/commits/<hash>
+        writeStoredFile(".minigit\\commits\\" + commitHash, commitData);
+
+        // Update HEAD
+        result = advanceHEAD(parent, commitHash);
+    }
+
+    if (result != REF_UPDATED) {
+        std::cerr << "? Could not update HEAD: " << refUpdateFailure(result) << ". Index kept.\n";
+        return;
+    }
 
     // Clear index
     std::ofstream clear(".minigit\\index", std::ios::trunc);
@@ -283,379 +784,2015 @@ void writeCommit(const std::string& message) {
     std::cout << "?? HEAD updated.\n";
 }
 
-// ========== CHECKOUT FUNCTIONALITY ==========
+// ========== SPARSE CHECKOUT ==========
+
+// Patterns in .minigit/sparse-checkout are compiled into a trie keyed by path
+// component. A pattern selects the path it names and everything below it;
+// components may use '*' and '?' globs, and '**' matches any number of
+// directories. Without a pattern file every path is selected. Checkout copies
+// the patterns it applied to .minigit/sparse-applied, so the next checkout
+// knows which paths the working tree was populated with.
+
+struct SparseNode {
+    std::map<std::string, int> literal;             // exact component -> node
+    std::vector<std::pair<std::string, int>> globs; // glob component -> node
+    int anyDepth = -1;                              // child reached through "**"
+    bool selfLoop = false;                          // node is a "**" and absorbs components
+    bool terminal = false;                          // a pattern ends here
+};
+
+struct SparseTrie {
+    bool enabled = false;
+    std::vector<SparseNode> nodes;
+};
+
+enum SparseMatch { SPARSE_EXCLUDED, SPARSE_PARTIAL, SPARSE_INCLUDED };
+
+bool globMatch(const char* pattern, const char* text) {
+    if (*pattern == '\0') return *text == '\0';
+    if (*pattern == '*')
+        return globMatch(pattern + 1, text) || (*text && globMatch(pattern, text + 1));
+    if (*text && (*pattern == '?' || *pattern == *text))
+        return globMatch(pattern + 1, text + 1);
+    return false;
+}
 
-std::string resolveCommit(const std::string& input) {
-    std::string refPath = ".minigit\\refs\\" + input;
-    if (fileExists(refPath)) {
-        std::ifstream ref(refPath.c_str());
-        std::string hash;
-        getline(ref, hash);
-        return hash;
-    }
-    std::string commitPath = ".minigit\\commits\\" + input;
-    if (fileExists(commitPath)) return input;
-    return "";
+void insertSparsePattern(SparseTrie& trie, const std::string& pattern) {
+    int node = 0;
+    for (const auto& part : splitPath(pattern)) {
+        int next;
+        if (part == "**") {
+            if (trie.nodes[node].anyDepth < 0) {
+                trie.nodes[node].anyDepth = (int)trie.nodes.size();
+                trie.nodes.emplace_back();
+                trie.nodes.back().selfLoop = true;
+            }
+            next = trie.nodes[node].anyDepth;
+        } else if (part.find_first_of("*?") != std::string::npos) {
+            next = -1;
+            for (auto& g : trie.nodes[node].globs)
+                if (g.first == part) next = g.second;
+            if (next < 0) {
+                next = (int)trie.nodes.size();
+                trie.nodes[node].globs.push_back({part, next});
+                trie.nodes.emplace_back();
+            }
+        } else {
+            auto it = trie.nodes[node].literal.find(part);
+            if (it != trie.nodes[node].literal.end()) {
+                next = it->second;
+            } else {
+                next = (int)trie.nodes.size();
+                trie.nodes[node].literal[part] = next;
+                trie.nodes.emplace_back();
+            }
+        }
+        node = next;
+    }
+    trie.nodes[node].terminal = true;
 }
 
-void restoreWorkingDirectory(const std::string& commitHash) {
-    std::string commitPath = ".minigit\\commits\\" + commitHash;
-    std::ifstream commit(commitPath.c_str());
+SparseTrie loadSparsePatterns(const std::string& path = ".minigit\\sparse-checkout") {
+    SparseTrie trie;
+    std::ifstream file(path.c_str());
+    if (!file) return trie;
 
-    if (!commit) {
-        std::cerr << "? Commit not found: " << commitHash << "\n";
-        return;
-    }
+    trie.enabled = true;
+    trie.nodes.emplace_back();
 
     std::string line;
-    bool readingBlobs = false;
-
-    std::cout << "?? Restoring working directory...\n";
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        insertSparsePattern(trie, line);
+    }
+    return trie;
+}
 
-    while (getline(commit, line)) {
-        if (line == "blobs:") {
-            readingBlobs = true;
-            continue;
-        }
+// Adds nodes reachable without consuming a component ("**" matching nothing).
+void sparseClosure(const SparseTrie& trie, std::set<int>& states) {
+    std::vector<int> pending(states.begin(), states.end());
+    while (!pending.empty()) {
+        int n = pending.back(); pending.pop_back();
+        int any = trie.nodes[n].anyDepth;
+        if (any >= 0 && states.insert(any).second) pending.push_back(any);
+    }
+}
 
-        if (readingBlobs && line.find("  ") == 0) {
-            std::istringstream iss(line);
-            std::string indent, filename, blobHash;
-            iss >> indent >> filename >> blobHash;
+SparseMatch matchSparse(const SparseTrie& trie, const std::string& path) {
+    if (!trie.enabled) return SPARSE_INCLUDED;
 
-            std::string blobPath = ".minigit\\objects\\" + blobHash;
-            std::ifstream blob(blobPath.c_str());
-            if (!blob) {
-                std::cerr << "?? Missing blob: " << blobHash << "\n";
-                continue;
-            }
+    std::set<int> states = {0};
+    sparseClosure(trie, states);
 
-            std::ofstream outFile(filename.c_str());
-            outFile << blob.rdbuf();
-            outFile.close();
-            blob.close();
+    for (const auto& part : splitPath(path)) {
+        for (int n : states)
+            if (trie.nodes[n].terminal) return SPARSE_INCLUDED;
 
-            std::cout << "? Restored: " << filename << "\n";
+        std::set<int> next;
+        for (int n : states) {
+            const SparseNode& node = trie.nodes[n];
+            if (node.selfLoop) next.insert(n);
+            auto it = node.literal.find(part);
+            if (it != node.literal.end()) next.insert(it->second);
+            for (auto& g : node.globs)
+                if (globMatch(g.first.c_str(), part.c_str())) next.insert(g.second);
         }
+        if (next.empty()) return SPARSE_EXCLUDED;
+        sparseClosure(trie, next);
+        states.swap(next);
     }
+
+    for (int n : states)
+        if (trie.nodes[n].terminal) return SPARSE_INCLUDED;
+    return SPARSE_PARTIAL;
 }
 
-void updateHEAD(const std::string& input) {
-    std::string refPath = ".minigit\\refs\\" + input;
-    std::ofstream head(".minigit\\HEAD");
+bool sparseIncludes(const SparseTrie& trie, const std::string& path) {
+    return matchSparse(trie, path) == SPARSE_INCLUDED;
+}
 
-    if (fileExists(refPath)) {
-        head << "ref: refs/" << input;
-        std::cout << "?? HEAD now points to branch: " << input << "\n";
-    } else {
-        head << input;
-        std::cout << "?? HEAD now points to commit: " << input << "\n";
-    }
-    head.close();
+void addSparsePattern(const std::string& pattern) {
+    std::ofstream file(".minigit\\sparse-checkout", std::ios::app);
+    file << pattern << "\n";
+    file.close();
+    std::cout << "? Sparse pattern added: " << pattern << "\n";
 }
 
-void checkoutBranch(const std::string& branchName) {
-    std::string refPath = ".minigit\\refs\\" + branchName;
+void disableSparseCheckout() {
+    if (std::remove(".minigit\\sparse-checkout") == 0)
+        std::cout << "? Sparse checkout disabled.\n";
+    else
+        std::cout << "?? Sparse checkout was not enabled.\n";
+}
 
-    if (!fileExists(refPath)) {
-        std::cerr << "? Branch '" << branchName << "' not found.\n";
-        return;
-    }
+std::map<std::string, std::string> readIndex() {
+    std::map<std::string, std::string> staged;
+    std::ifstream index(".minigit\\index");
+    std::string filename, hash;
+    while (index >> filename >> hash)
+        staged[normalizePath(filename)] = hash;
+    return staged;
+}
 
-    std::ifstream ref(refPath.c_str());
-    std::string commitHash;
-    getline(ref, commitHash);
-    ref.close();
+// Walks the working tree, descending only into directories the sparse
+// patterns can still select.
+void collectWorkingFiles(const fs::path& dir, const SparseTrie& sparse, std::set<std::string>& files) {
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string rel = normalizePath(it->path().lexically_relative(".").generic_string());
+        if (rel.rfind(".minigit", 0) == 0) continue;
+
+        SparseMatch match = matchSparse(sparse, rel);
+        if (match == SPARSE_EXCLUDED) continue;
+
+        if (it->is_directory(ec))
+            collectWorkingFiles(it->path(), sparse, files);
+        else if (match == SPARSE_INCLUDED)
+            files.insert(rel);
+    }
+}
 
-    restoreWorkingDirectory(commitHash);
-    updateHEAD(branchName);
+// ========== FILESYSTEM MONITOR ==========
+
+// The watcher appends every changed path to .minigit/fsmonitor as
+// "<seq> P <path>", and its own markers (overflow, stopped, cookies) as
+// "<seq> M <marker>", below a "generation <id> <pid> <base>" header.
+// Consumers keep the working-tree hashes they last saw in
+// .minigit/fsmonitor-cache, and in .minigit/fsmonitor-token the generation,
+// sequence number and journal offset they are current up to; they read the
+// journal from that offset on and rehash only the paths journaled since. A new
+// generation, a dead watcher or an overflow marker means the journal cannot be
+// trusted and a full scan is done instead. Before trusting the journal a
+// consumer writes a cookie file into the working tree and waits for the
+// watcher to journal it, so no earlier event is still sitting in the inotify
+// queue.
+//
+// Every FS_MONITOR_COMPACT_ENTRIES events the watcher drops the entries the
+// token says consumers have seen and records the last dropped sequence number
+// as the header's base. The cache is append-only in the same way: changed
+// paths are added as "<hash> <path>" or "- <path>" lines, and the file is only
+// rewritten once superseded lines outnumber the live ones.
+
+struct FsMonitorPosition {
+    std::string generation;
+    long base = 0;
+    long seq = 0;
+    std::streamoff offset = 0;
+};
+
+struct FsMonitorEntry {
+    long seq;
+    char kind;  // 'P' path, 'M' marker
+    std::string value;
+};
+
+struct FsMonitorJournal {
+    bool valid = false;
+    FsMonitorPosition end;  // just past the last complete entry
+    std::vector<FsMonitorEntry> entries;
+};
+
+const long FS_MONITOR_COMPACT_ENTRIES = 4096;
+
+std::atomic<bool> fsMonitorStop(false);
+std::thread fsMonitorThread;
+
+// The token is "<generation> <base> <seq> <offset> <sparse key>".
+bool readFsMonitorToken(FsMonitorPosition& position, std::string& sparseKey) {
+    std::ifstream file(".minigit\\fsmonitor-token");
+    long long offset = 0;
+    if (!(file >> position.generation >> position.base >> position.seq >> offset >> sparseKey))
+        return false;
+    position.offset = (std::streamoff)offset;
+    return true;
 }
 
-void checkoutCommit(const std::string& commitHash) {
-    std::string commitPath = ".minigit\\commits\\" + commitHash;
-    if (!fileExists(commitPath)) {
-        std::cerr << "? Commit not found: " << commitHash << "\n";
-        return;
+// Replaced by rename so the watcher never reads a half-written token.
+void writeFsMonitorToken(const FsMonitorPosition& position, const std::string& sparseKey) {
+    {
+        std::ofstream file(".minigit\\fsmonitor-token.tmp", std::ios::trunc);
+        file << position.generation << " " << position.base << " " << position.seq << " "
+             << (long long)position.offset << " " << sparseKey << "\n";
     }
+    std::error_code ec;
+    fs::rename(".minigit\\fsmonitor-token.tmp", ".minigit\\fsmonitor-token", ec);
+    if (ec) std::remove(".minigit\\fsmonitor-token.tmp");
+}
 
-    restoreWorkingDirectory(commitHash);
-    updateHEAD(commitHash);
+#ifdef __linux__
+const uint32_t FS_MONITOR_EVENTS = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF;
+
+bool watchTree(int fd, std::map<int, std::string>& dirs, const std::string& rel) {
+    std::string path = rel.empty() ? "." : rel;
+    int wd = inotify_add_watch(fd, path.c_str(), FS_MONITOR_EVENTS | IN_ONLYDIR);
+    if (wd < 0) return false;
+    dirs[wd] = rel;
+
+    std::error_code ec;
+    for (fs::directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string child = normalizePath(it->path().lexically_relative(".").generic_string());
+        if (child.rfind(".minigit", 0) == 0) continue;
+        if (it->is_directory(ec) && !it->is_symlink(ec) && !watchTree(fd, dirs, child))
+            return false;
+    }
+    return true;
 }
 
-// ========== DIFF VIEWER ==========
+// Drops the entries the consumers' token has moved past. Runs on the watcher
+// thread, the journal's only writer, so nothing is appended meanwhile.
+void compactFsMonitorJournal(const std::string& generation, long& base) {
+    FsMonitorPosition consumer;
+    std::string sparseKey;
+    if (!readFsMonitorToken(consumer, sparseKey) || consumer.generation != generation ||
+        consumer.seq <= base)
+        return;
 
-void diffFiles(const std::string& filename,
-               const std::vector<std::string>& oldLines,
-               const std::vector<std::string>& newLines)
-{
-    std::cout << "\n--- " << filename << " (old)\n";
-    std::cout << "+++ " << filename << " (new)\n";
+    std::ifstream in(".minigit\\fsmonitor");
+    std::ofstream out(".minigit\\fsmonitor.tmp", std::ios::trunc);
+    std::string line;
+    getline(in, line);
+    out << "generation " << generation << " " << getpid() << " " << consumer.seq << "\n";
+    while (getline(in, line))
+        if (atol(line.c_str()) > consumer.seq) out << line << "\n";
+    in.close();
+    out.close();
 
-    size_t i = 0, j = 0;
-    while (i < oldLines.size() || j < newLines.size()) {
-        if (i < oldLines.size() && j < newLines.size()) {
-            if (oldLines[i] == newLines[j]) {
-                std::cout << "  " << oldLines[i] << "\n";
-                ++i; ++j;
-            } else {
-                std::cout << "- " << oldLines[i] << "\n";
-                std::cout << "+ " << newLines[j] << "\n";
-                ++i; ++j;
-            }
-        } else if (i < oldLines.size()) {
-            std::cout << "- " << oldLines[i++] << "\n";
-        } else if (j < newLines.size()) {
-            std::cout << "+ " << newLines[j++] << "\n";
-        }
+    std::error_code ec;
+    if (!out.fail()) fs::rename(".minigit\\fsmonitor.tmp", ".minigit\\fsmonitor", ec);
+    if (out.fail() || ec) {
+        std::remove(".minigit\\fsmonitor.tmp");
+        return;
     }
+    base = consumer.seq;
 }
 
-void showDiff() {
-    std::string hash1, hash2;
-    std::cout << "Enter first commit hash: ";
-    std::cin >> hash1;
-    std::cout << "Enter second commit hash: ";
-    std::cin >> hash2;
+void runFsMonitor(int fd, std::map<int, std::string> dirs, std::string generation) {
+    std::ofstream journal(".minigit\\fsmonitor", std::ios::app);
+    long seq = 0, base = 0, lastCompaction = 0;
+    alignas(struct inotify_event) char buf[8192];
 
-    auto blobs1 = readBlobsFromCommit(hash1);
-    auto blobs2 = readBlobsFromCommit(hash2);
+    while (!fsMonitorStop) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0) continue;
 
-    std::set<std::string> allFiles;
-    for (auto& b : blobs1) allFiles.insert(b.first);
-    for (auto& b : blobs2) allFiles.insert(b.first);
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0) continue;
 
-    for (const auto& file : allFiles) {
-        std::string blob1 = blobs1.count(file) ? blobs1[file] : "";
-        std::string blob2 = blobs2.count(file) ? blobs2[file] : "";
+        for (char* ptr = buf; ptr < buf + len; ) {
+            struct inotify_event* ev = (struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
 
-        auto lines1 = blob1.empty() ? std::vector<std::string>{} : readBlobLines(blob1);
-        auto lines2 = blob2.empty() ? std::vector<std::string>{} : readBlobLines(blob2);
+            if (ev->mask & IN_Q_OVERFLOW) {
+                journal << ++seq << " M overflow\n";
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                dirs.erase(ev->wd);
+                continue;
+            }
+
+            auto it = dirs.find(ev->wd);
+            if (it == dirs.end()) continue;
+
+            std::string rel = it->second;
+            if (ev->len > 0) rel = rel.empty() ? ev->name : rel + "/" + ev->name;
+            if (rel.rfind(".minigit-cookie", 0) == 0) {
+                if (ev->mask & IN_CLOSE_WRITE)
+                    journal << ++seq << " M cookie " << rel << "\n";
+                continue;
+            }
+            if (rel.empty() || rel.rfind(".minigit", 0) == 0) continue;
+
+            // New directories need their own watches; if that fails the
+            // journal can no longer see everything.
+            if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR) &&
+                !watchTree(fd, dirs, rel))
+                journal << ++seq << " M overflow\n";
+
+            journal << ++seq << " P " << rel << "\n";
+        }
+        journal.flush();
+
+        if (seq - lastCompaction >= FS_MONITOR_COMPACT_ENTRIES) {
+            lastCompaction = seq;
+            journal.close();
+            compactFsMonitorJournal(generation, base);
+            journal.open(".minigit\\fsmonitor", std::ios::app);
+        }
+    }
+
+    journal << ++seq << " M stopped\n";
+    journal.close();
+    ::close(fd);
+}
+#endif
+
+void startFsMonitor() {
+#ifdef __linux__
+    if (fsMonitorThread.joinable()) {
+        std::cout << "?? Filesystem monitor already running.\n";
+        return;
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "? inotify unavailable, status will keep scanning the working tree.\n";
+        return;
+    }
+
+    std::map<int, std::string> dirs;
+    if (!watchTree(fd, dirs, "")) {
+        std::cerr << "? Could not watch every directory (inotify watch limit?).\n";
+        ::close(fd);
+        return;
+    }
+
+    // Header goes out only once every watch is in place, so consumers
+    // full-scan until then.
+    std::string generation = simpleHash(std::to_string(time(NULL)) + "-" + std::to_string(getpid()));
+    std::ofstream journal(".minigit\\fsmonitor", std::ios::trunc);
+    journal << "generation " << generation << " " << getpid() << " 0\n";
+    journal.close();
+
+    fsMonitorStop = false;
+    fsMonitorThread = std::thread(runFsMonitor, fd, dirs, generation);
+    std::cout << "? Filesystem monitor watching " << dirs.size() << " director(ies).\n";
+#else
+    std::cerr << "? Filesystem monitor needs Linux inotify; status will keep scanning the working tree.\n";
+#endif
+}
+
+void stopFsMonitor() {
+    if (!fsMonitorThread.joinable()) {
+        std::cout << "?? Filesystem monitor is not running.\n";
+        return;
+    }
+    fsMonitorStop = true;
+    fsMonitorThread.join();
+    std::cout << "? Filesystem monitor stopped.\n";
+}
+
+// Reads the entries after `from`. If the journal was restarted or compacted
+// since, it is read from the top and end.base tells how much is gone.
+FsMonitorJournal readFsMonitorJournal(const FsMonitorPosition& from) {
+    FsMonitorJournal journal;
+#ifdef __linux__
+    std::ifstream file(".minigit\\fsmonitor", std::ios::binary);
+    if (!file) return journal;
+
+    std::string line, tag;
+    long pid = 0;
+    if (!getline(file, line)) return journal;
+    std::istringstream header(line);
+    if (!(header >> tag >> journal.end.generation >> pid >> journal.end.base) || tag != "generation")
+        return journal;
+    if (kill(pid, 0) != 0 && errno != EPERM) return journal;
+
+    std::streamoff start = file.tellg();
+    journal.end.seq = journal.end.base;
+    if (journal.end.generation == from.generation && journal.end.base == from.base &&
+        from.offset > start) {
+        start = from.offset;
+        journal.end.seq = from.seq;
+    }
+    file.seekg(start);
+
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    std::string data = buffer.str();
+    // Ignore a trailing line the watcher has not finished writing yet.
+    data = data.substr(0, data.rfind('\n') + 1);
+    journal.end.offset = start + (std::streamoff)data.size();
+
+    std::istringstream lines(data);
+    while (getline(lines, line)) {
+        size_t space = line.find(' ');
+        if (space == std::string::npos || line.size() < space + 3) continue;
+        FsMonitorEntry entry = {atol(line.substr(0, space).c_str()), line[space + 1],
+                                line.substr(space + 3)};
+        if (entry.kind == 'M' && entry.value == "stopped") return journal;
+        journal.entries.push_back(entry);
+        journal.end.seq = entry.seq;
+    }
+    journal.valid = true;
+#endif
+    return journal;
+}
+
+// Returns a journal that includes every event raised before the call, or an
+// invalid one if the watcher does not answer in time.
+FsMonitorJournal syncFsMonitorJournal(const FsMonitorPosition& from) {
+    FsMonitorJournal journal = readFsMonitorJournal(from);
+#ifdef __linux__
+    if (!journal.valid) return journal;
+
+    static int cookieCounter = 0;
+    std::string cookie = ".minigit-cookie-" + std::to_string(getpid()) + "-" +
+                         std::to_string(++cookieCounter);
+    std::ofstream(cookie.c_str()) << "sync\n";
+
+    for (int attempt = 0; attempt < 200; ++attempt) {
+        journal = readFsMonitorJournal(from);
+        if (!journal.valid) break;
+        for (auto it = journal.entries.rbegin(); it != journal.entries.rend(); ++it) {
+            if (it->kind == 'M' && it->value == "cookie " + cookie) {
+                std::remove(cookie.c_str());
+                return journal;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    std::remove(cookie.c_str());
+    journal.valid = false;
+#endif
+    return journal;
+}
+
+// "none" when the file is absent, so an empty pattern list keys differently.
+std::string sparsePatternsKey(const std::string& path = ".minigit\\sparse-checkout") {
+    std::ifstream file(path.c_str());
+    if (!file) return "none";
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    return simpleHash(buffer.str());
+}
+
+// Replays the cache into `hashes`; `lines` counts every line read, live or
+// superseded. A last line without its newline was cut short and is ignored.
+bool readFsMonitorCache(std::map<std::string, std::string>& hashes, size_t& lines) {
+    std::ifstream cache(".minigit\\fsmonitor-cache");
+    if (!cache) return false;
+
+    std::string line;
+    while (getline(cache, line) && !cache.eof()) {
+        size_t space = line.find(' ');
+        if (space == std::string::npos) continue;
+        std::string path = line.substr(space + 1);
+        if (line.compare(0, space, "-") == 0) hashes.erase(path);
+        else hashes[path] = line.substr(0, space);
+        ++lines;
+    }
+    return true;
+}
+
+// Fills `hashes` with path -> content hash for every selected working file.
+// With a live journal only paths changed since the cached token are rehashed;
+// otherwise the whole tree is scanned, unless allowFullScan is false, in which
+// case false is returned and `hashes` is left empty.
+bool loadWorkingTreeHashes(const SparseTrie& sparse, std::map<std::string, std::string>& hashes,
+                           bool allowFullScan) {
+    FsMonitorPosition from;
+    std::string cachedKey;
+    bool haveToken = readFsMonitorToken(from, cachedKey);
+    FsMonitorJournal journal = syncFsMonitorJournal(from);
+    std::string sparseKey = sparsePatternsKey();
+
+    // A base past our sequence number means entries we never saw were dropped.
+    bool incremental = haveToken && journal.valid && journal.end.generation == from.generation &&
+                       journal.end.base <= from.seq && cachedKey == sparseKey;
+
+    std::set<std::string> dirty;
+    if (incremental) {
+        for (auto& entry : journal.entries) {
+            if (entry.seq <= from.seq) continue;
+            if (entry.kind == 'M' && entry.value == "overflow") {
+                incremental = false;
+                break;
+            }
+            if (entry.kind == 'P') dirty.insert(entry.value);
+        }
+    }
+
+    size_t cacheLines = 0;
+    if (incremental) incremental = readFsMonitorCache(hashes, cacheLines);
+
+    // Paths whose cached hash may change, with the hash they had before.
+    std::map<std::string, std::string> touched;
+    if (incremental) {
+        for (const auto& path : dirty) {
+            auto it = hashes.lower_bound(path);
+            while (it != hashes.end() &&
+                   (it->first == path || it->first.rfind(path + "/", 0) == 0)) {
+                touched.insert(*it);
+                it = hashes.erase(it);
+            }
+
+            SparseMatch match = matchSparse(sparse, path);
+            if (match == SPARSE_EXCLUDED) continue;
+
+            std::error_code ec;
+            std::set<std::string> files;
+            if (fs::is_directory(path, ec)) collectWorkingFiles(path, sparse, files);
+            else if (match == SPARSE_INCLUDED && fs::exists(path, ec)) files.insert(path);
+            for (const auto& f : files) {
+                touched.insert({f, ""});
+                hashes[f] = hashWorkingFile(f);
+            }
+        }
+    } else {
+        hashes.clear();
+        if (!allowFullScan) return false;
+        std::set<std::string> files;
+        collectWorkingFiles(".", sparse, files);
+        for (const auto& f : files) hashes[f] = hashWorkingFile(f);
+    }
+
+    if (!journal.valid) return true;
+
+    if (incremental && cacheLines + touched.size() <= 2 * hashes.size() + FS_MONITOR_COMPACT_ENTRIES) {
+        std::ofstream out(".minigit\\fsmonitor-cache", std::ios::app);
+        for (auto& t : touched) {
+            auto now = hashes.find(t.first);
+            if (now == hashes.end()) {
+                if (!t.second.empty()) out << "- " << t.first << "\n";
+            } else if (now->second != t.second) {
+                out << now->second << " " << now->first << "\n";
+            }
+        }
+    } else {
+        std::ofstream out(".minigit\\fsmonitor-cache", std::ios::trunc);
+        for (auto& h : hashes) out << h.second << " " << h.first << "\n";
+    }
+    writeFsMonitorToken(journal.end, sparseKey);
+    return true;
+}
+
+// ========== CHECKOUT FUNCTIONALITY ==========
+
+// Hash of the commit a ref, HEAD or commit hash names, or "" when that
+// commit is not in the store.
+std::string resolveCommit(const std::string& input) {
+    std::string hash = input == "HEAD" ? readHEAD() : lookupRef(input);
+    if (hash.empty()) hash = input;
+    if (!isValidRefName(hash) || !fileExists(".minigit\\commits\\" + hash)) return "";
+    return hash;
+}
+
+// Removes the now-empty directories above a deleted file.
+void pruneEmptyDirectories(const std::string& filename) {
+    std::error_code ec;
+    for (fs::path dir = fs::path(filename).parent_path(); !dir.empty(); dir = dir.parent_path()) {
+        if (!fs::is_empty(dir, ec) || ec || !fs::remove(dir, ec)) break;
+    }
+}
+
+// Returns false, leaving the tree untouched, if the commit cannot be read.
+bool restoreWorkingDirectory(const std::string& commitHash) {
+    CommitRecord commit;
+    if (!readCommit(commitHash, commit, true)) {
+        std::cerr << "? Commit not found: " << commitHash << "\n";
+        return false;
+    }
+
+    SparseTrie sparse = loadSparsePatterns();
+    int skipped = 0, unchanged = 0, removed = 0;
+
+    // When the patterns narrowed, drop clean copies of paths only the old
+    // patterns selected, judged against the HEAD they were checked out from;
+    // local edits stay. Unchanged patterns cost nothing here.
+    if (sparsePatternsKey(".minigit\\sparse-applied") != sparsePatternsKey()) {
+        SparseTrie applied = loadSparsePatterns(".minigit\\sparse-applied");
+        for (auto& b : readBlobsFromCommit(readHEAD())) {
+            const std::string& filename = b.first;
+            if (!sparseIncludes(applied, filename) || sparseIncludes(sparse, filename)) continue;
+            std::error_code ec;
+            if (fs::is_regular_file(filename, ec) && hashWorkingFile(filename) == b.second &&
+                fs::remove(filename, ec)) {
+                ++removed;
+                pruneEmptyDirectories(filename);
+            }
+        }
+    }
+
+    // Only trust current file contents when the monitor journal can vouch
+    // for them; otherwise every selected file is rewritten.
+    std::map<std::string, std::string> current;
+    bool incremental = loadWorkingTreeHashes(sparse, current, false);
+
+    std::cout << "?? Restoring working directory...\n";
+
+    for (const auto& entry : commit.blobs) {
+        const std::string& filename = entry.first;
+        const std::string& blobHash = entry.second;
+
+        if (!sparseIncludes(sparse, filename)) {
+            ++skipped;
+            continue;
+        }
+
+        if (incremental) {
+            auto it = current.find(normalizePath(filename));
+            if (it != current.end() && it->second == blobHash) {
+                ++unchanged;
+                continue;
+            }
+        }
+
+        std::string blobPath = ".minigit\\objects\\" + blobHash;
+        std::ifstream blob(blobPath.c_str());
+        if (!blob) {
+            std::cerr << "?? Missing blob: " << blobHash << " (run Integrity Check)\n";
+            continue;
+        }
+
+        std::error_code ec;
+        fs::path parent = fs::path(filename).parent_path();
+        if (!parent.empty()) fs::create_directories(parent, ec);
+
+        std::ofstream outFile(filename.c_str());
+        if (outFile && blob.peek() != std::ifstream::traits_type::eof())
+            outFile << blob.rdbuf();
+        outFile.close();
+        blob.close();
+
+        if (outFile.fail()) {
+            std::cerr << "? Failed to write: " << filename << "\n";
+            continue;
+        }
+
+        std::cout << "? Restored: " << filename << "\n";
+    }
+
+    if (skipped > 0)
+        std::cout << "?? Skipped " << skipped << " path(s) outside sparse checkout.\n";
+    if (removed > 0)
+        std::cout << "?? Removed " << removed << " clean file(s) no longer selected.\n";
+    if (unchanged > 0)
+        std::cout << "?? Left " << unchanged << " unchanged file(s) in place.\n";
+
+    std::error_code ec;
+    if (sparse.enabled)
+        fs::copy_file(".minigit\\sparse-checkout", ".minigit\\sparse-applied",
+                      fs::copy_options::overwrite_existing, ec);
+    else
+        fs::remove(".minigit\\sparse-applied", ec);
+    return true;
+}
+
+void updateHEAD(const std::string& input) {
+    if (!isValidRefName(input)) {
+        std::cerr << "? Invalid branch or commit name: " << input << "\n";
+        return;
+    }
+
+    bool isBranch = !lookupRef(input).empty();
+    std::string value = isBranch ? "ref: refs/" + input : input;
+
+    RefUpdate result = REF_STALE;
+    for (int attempt = 0; attempt < REF_UPDATE_RETRIES && result == REF_STALE; ++attempt)
+        result = updateRefWithRetry("HEAD", lookupRef("HEAD"), value);
+
+    if (result != REF_UPDATED) {
+        std::cerr << "? Could not update HEAD: " << refUpdateFailure(result) << ".\n";
+    } else if (isBranch) {
+        std::cout << "?? HEAD now points to branch: " << input << "\n";
+    } else {
+        std::cout << "?? HEAD now points to commit: " << input << "\n";
+    }
+}
+
+void checkoutBranch(const std::string& branchName) {
+    if (!isValidRefName(branchName)) {
+        std::cerr << "? Invalid branch name: " << branchName << "\n";
+        return;
+    }
+
+    std::string commitHash = lookupRef(branchName);
+
+    if (commitHash.empty()) {
+        std::cerr << "? Branch '" << branchName << "' not found.\n";
+        return;
+    }
+
+    if (!restoreWorkingDirectory(commitHash)) return;
+    updateHEAD(branchName);
+}
+
+void checkoutCommit(const std::string& commitHash) {
+    std::string commitPath = ".minigit\\commits\\" + commitHash;
+    if (!fileExists(commitPath)) {
+        std::cerr << "? Commit not found: " << commitHash << "\n";
+        return;
+    }
+
+    if (!restoreWorkingDirectory(commitHash)) return;
+    updateHEAD(commitHash);
+}
+
+// ========== STATUS ==========
+
+void showStatus() {
+    SparseTrie sparse = loadSparsePatterns();
+    std::string headHash = readHEAD();
+
+    std::map<std::string, std::string> tracked;
+    for (auto& b : readBlobsFromCommit(headHash))
+        tracked[normalizePath(b.first)] = b.second;
+    auto staged = readIndex();
+
+    std::map<std::string, std::string> working;
+    loadWorkingTreeHashes(sparse, working, true);
+
+    std::set<std::string> paths;
+    for (auto& w : working) paths.insert(w.first);
+    for (auto& t : tracked) paths.insert(t.first);
+    for (auto& s : staged) paths.insert(s.first);
+
+    std::cout << "?? Status of HEAD " << (headHash.empty() ? "none" : headHash) << "\n";
+    if (sparse.enabled)
+        std::cout << "?? Sparse checkout enabled, showing selected paths only.\n";
+
+    bool clean = true;
+    for (const auto& path : paths) {
+        if (!sparseIncludes(sparse, path)) continue;
+
+        bool isTracked = tracked.count(path) > 0;
+        bool isStaged = staged.count(path) > 0;
+        std::string expected = isStaged ? staged[path] : (isTracked ? tracked[path] : "");
+
+        if (isStaged && (!isTracked || tracked[path] != staged[path])) {
+            std::cout << "  staged:    " << path << "\n";
+            clean = false;
+        }
+
+        if (expected.empty()) {
+            std::cout << "  untracked: " << path << "\n";
+            clean = false;
+        } else if (!working.count(path)) {
+            std::cout << "  deleted:   " << path << "\n";
+            clean = false;
+        } else if (working[path] != expected) {
+            std::cout << "  modified:  " << path << "\n";
+            clean = false;
+        }
+    }
+
+    if (clean)
+        std::cout << "? Working directory clean.\n";
+}
+
+void stageChangedFiles() {
+    SparseTrie sparse = loadSparsePatterns();
+
+    std::map<std::string, std::string> tracked;
+    for (auto& b : readBlobsFromCommit(readHEAD()))
+        tracked[normalizePath(b.first)] = b.second;
+    auto staged = readIndex();
+
+    std::map<std::string, std::string> working;
+    loadWorkingTreeHashes(sparse, working, true);
+
+    int count = 0;
+    for (auto& w : working) {
+        std::string expected = staged.count(w.first) ? staged[w.first]
+                             : (tracked.count(w.first) ? tracked[w.first] : "");
+        if (w.second != expected) {
+            storeBlobAndStage(w.first);
+            ++count;
+        }
+    }
+
+    if (count == 0)
+        std::cout << "? Nothing to stage.\n";
+}
+
+// ========== DIFF VIEWER ==========
+
+void diffFiles(const std::string& filename,
+               const std::vector<std::string>& oldLines,
+               const std::vector<std::string>& newLines)
+{
+    std::cout << "\n--- " << filename << " (old)\n";
+    std::cout << "+++ " << filename << " (new)\n";
+
+    size_t i = 0, j = 0;
+    while (i < oldLines.size() || j < newLines.size()) {
+        if (i < oldLines.size() && j < newLines.size()) {
+            if (oldLines[i] == newLines[j]) {
+                std::cout << "  " << oldLines[i] << "\n";
+                ++i; ++j;
+            } else {
+                std::cout << "- " << oldLines[i] << "\n";
+                std::cout << "+ " << newLines[j] << "\n";
+                ++i; ++j;
+            }
+        } else if (i < oldLines.size()) {
+            std::cout << "- " << oldLines[i++] << "\n";
+        } else if (j < newLines.size()) {
+            std::cout << "+ " << newLines[j++] << "\n";
+        }
+    }
+}
+
+void showDiff() {
+    std::string hash1, hash2;
+    std::cout << "Enter first commit hash: ";
+    std::cin >> hash1;
+    std::cout << "Enter second commit hash: ";
+    std::cin >> hash2;
+
+    auto blobs1 = readBlobsFromCommit(hash1);
+    auto blobs2 = readBlobsFromCommit(hash2);
+
+    std::set<std::string> allFiles;
+    for (auto& b : blobs1) allFiles.insert(b.first);
+    for (auto& b : blobs2) allFiles.insert(b.first);
+
+    for (const auto& file : allFiles) {
+        std::string blob1 = blobs1.count(file) ? blobs1[file] : "";
+        std::string blob2 = blobs2.count(file) ? blobs2[file] : "";
+
+        auto lines1 = blob1.empty() ? std::vector<std::string>{} : readBlobLines(blob1);
+        auto lines2 = blob2.empty() ? std::vector<std::string>{} : readBlobLines(blob2);
+
+        diffFiles(file, lines1, lines2);
+    }
+}
+
+// ========== DIFF STATISTICS ==========
+
+// Per-file insert/delete counts, using the same line-by-line pairing as
+// diffFiles. Files whose blob hash is unchanged are skipped without reading
+// them; the rest are compared through memory-mapped blobs.
+
+struct FileStat {
+    std::string path;
+    size_t inserted = 0;
+    size_t deleted = 0;
+};
+
+std::vector<std::string_view> splitLines(const MappedFile& file) {
+    std::vector<std::string_view> lines;
+    const char* pos = file.data;
+    const char* end = file.data + file.size;
+    while (pos < end) {
+        const char* nl = (const char*)memchr(pos, '\n', end - pos);
+        if (!nl) nl = end;
+        lines.emplace_back(pos, nl - pos);
+        pos = nl + 1;
+    }
+    return lines;
+}
+
+void countLineChanges(const std::string& oldBlob, const std::string& newBlob, FileStat& stat) {
+    MappedFile oldFile(".minigit\\objects\\" + oldBlob);
+    MappedFile newFile(".minigit\\objects\\" + newBlob);
+    auto oldLines = oldBlob.empty() ? std::vector<std::string_view>{} : splitLines(oldFile);
+    auto newLines = newBlob.empty() ? std::vector<std::string_view>{} : splitLines(newFile);
+
+    size_t common = std::min(oldLines.size(), newLines.size());
+    for (size_t i = 0; i < common; ++i) {
+        if (oldLines[i] != newLines[i]) {
+            ++stat.deleted;
+            ++stat.inserted;
+        }
+    }
+    stat.deleted += oldLines.size() - common;
+    stat.inserted += newLines.size() - common;
+}
+
+std::vector<FileStat> computeDiffStat(const std::string& oldCommit, const std::string& newCommit) {
+    auto oldBlobs = oldCommit.empty() ? std::map<std::string, std::string>{} : readBlobsFromCommit(oldCommit);
+    auto newBlobs = newCommit.empty() ? std::map<std::string, std::string>{} : readBlobsFromCommit(newCommit);
+
+    std::set<std::string> allFiles;
+    for (auto& b : oldBlobs) allFiles.insert(b.first);
+    for (auto& b : newBlobs) allFiles.insert(b.first);
+
+    std::vector<FileStat> stats;
+    for (const auto& file : allFiles) {
+        std::string oldBlob = oldBlobs.count(file) ? oldBlobs[file] : "";
+        std::string newBlob = newBlobs.count(file) ? newBlobs[file] : "";
+        if (oldBlob == newBlob) continue;
+
+        FileStat stat;
+        stat.path = file;
+        countLineChanges(oldBlob, newBlob, stat);
+        stats.push_back(stat);
+    }
+    return stats;
+}
+
+void printDiffStat(const std::vector<FileStat>& stats) {
+    size_t width = 0, largest = 0, inserted = 0, deleted = 0;
+    for (auto& s : stats) {
+        width = std::max(width, s.path.size());
+        largest = std::max(largest, s.inserted + s.deleted);
+    }
+
+    const size_t barWidth = 40;
+    for (auto& s : stats) {
+        size_t total = s.inserted + s.deleted;
+        size_t plus = s.inserted, minus = s.deleted;
+        if (total == 0) {
+            // Content changed without a line change, e.g. a trailing newline.
+            plus = minus = 0;
+        } else if (largest > barWidth) {
+            // Scale the whole bar once, then split it so +/- stay in proportion
+            // and each non-zero side keeps at least one mark if there is room.
+            size_t bar = (total * barWidth + largest - 1) / largest;
+            plus = (s.inserted * bar + total / 2) / total;
+            if (s.inserted > 0 && plus == 0) plus = 1;
+            if (s.deleted > 0 && plus == bar && bar > 1) --plus;
+            minus = bar - plus;
+        }
+        std::cout << " " << std::left << std::setw((int)width) << s.path << std::right
+                  << " | " << std::setw(5) << total << " "
+                  << std::string(plus, '+') << std::string(minus, '-') << "\n";
+        inserted += s.inserted;
+        deleted += s.deleted;
+    }
+    std::cout << " " << stats.size() << " file(s) changed, " << inserted << " insertion(s)(+), "
+              << deleted << " deletion(s)(-)\n";
+}
+
+void showDiffStat() {
+    std::string hash1, hash2;
+    std::cout << "Enter first commit hash: ";
+    std::cin >> hash1;
+    std::cout << "Enter second commit hash: ";
+    std::cin >> hash2;
+
+    printDiffStat(computeDiffStat(hash1, hash2));
+}
+
+// ========== LOG HISTORY ==========
+
+void showLog(bool oneline = false) {
+    std::string commitHash = readHEAD();
+
+    if (commitHash.empty()) {
+        std::cout << "?? No commits found.\n";
+        return;
+    }
+
+    while (!commitHash.empty()) {
+        CommitRecord commit;
+
+        if (!readCommit(commitHash, commit, false)) {
+            std::cerr << "? Commit file not found: " << commitHash << "\n";
+            break;
+        }
+
+        // Display based on mode
+        if (oneline) {
+            std::cout << commitHash << " - " << commit.message << "\n";
+        } else {
+            std::cout << "?? Commit: " << commitHash << "\n";
+            std::cout << "?? " << commit.timestamp << "\n";
+            std::cout << "?? " << commit.message << "\n\n";
+        }
+
+        // Move to parent
+        commitHash = commit.parents.empty() ? "" : commit.parents[0];
+    }
+}
+
+// Same walk as showLog, but every commit is diffed against its parent on a
+// pool of workers; entries still print in log order, each as soon as its
+// statistics are ready.
+void showLogStat() {
+    std::vector<std::pair<std::string, CommitRecord>> chain;
+    for (std::string hash = readHEAD(); !hash.empty(); ) {
+        CommitRecord commit;
+        if (!readCommit(hash, commit, false)) {
+            std::cerr << "? Commit file not found: " << hash << "\n";
+            break;
+        }
+        std::string parent = commit.parents.empty() ? "" : commit.parents[0];
+        chain.push_back({hash, std::move(commit)});
+        hash = parent;
+    }
+
+    if (chain.empty()) {
+        std::cout << "?? No commits found.\n";
+        return;
+    }
+
+    std::vector<std::vector<FileStat>> stats(chain.size());
+    std::vector<bool> ready(chain.size(), false);
+    std::mutex mutex;
+    std::condition_variable done;
+
+    // The pool runs beside this thread, which prints entries as they finish.
+    std::thread pool([&] {
+        parallelFor(chain.size(), [&](size_t i) {
+            const auto& parents = chain[i].second.parents;
+            auto result = computeDiffStat(parents.empty() ? "" : parents[0], chain[i].first);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            stats[i] = std::move(result);
+            ready[i] = true;
+            done.notify_all();
+        });
+    });
+
+    for (size_t i = 0; i < chain.size(); ++i) {
+        std::cout << "?? Commit: " << chain[i].first << "\n";
+        std::cout << "?? " << chain[i].second.timestamp << "\n";
+        std::cout << "?? " << chain[i].second.message << "\n";
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&] { return ready[i]; });
+        }
+        printDiffStat(stats[i]);
+        std::vector<FileStat>().swap(stats[i]);
+        std::cout << "\n";
+    }
+
+    pool.join();
+}
+
+// ========== MERGE FUNCTIONALITY ==========
+
+std::set<std::string> getAncestors(const std::string& root) {
+    std::set<std::string> visited;
+    std::queue<std::string> q;
+    q.push(root);
+
+    while (!q.empty()) {
+        std::string current = q.front(); q.pop();
+        if (visited.count(current)) continue;
+        visited.insert(current);
+
+        for (auto& parent : readCommitParents(current)) {
+            q.push(parent);
+        }
+    }
+    return visited;
+}
+
+std::string findLCA(const std::string& h1, const std::string& h2) {
+    auto a1 = getAncestors(h1);
+    std::queue<std::string> q;
+    q.push(h2);
+    std::set<std::string> visited;
+
+    while (!q.empty()) {
+        std::string current = q.front(); q.pop();
+        if (visited.count(current)) continue;
+        visited.insert(current);
+        if (a1.count(current)) return current;
+
+        for (auto& parent : readCommitParents(current)) q.push(parent);
+    }
+    return "";
+}
+
+void simpleMerge(const std::string& branchName) {
+    std::string branchHash = getBranchHash(branchName);
+
+    if (branchHash.empty()) {
+        std::cerr << "? Branch not found: " << branchName << "\n";
+        return;
+    }
+
+    std::string newHash;
+    RefUpdate result = REF_STALE;
+
+    // Redo the merge on top of HEAD if another writer moved it meanwhile
+    for (int attempt = 0; attempt < REF_UPDATE_RETRIES && result == REF_STALE; ++attempt) {
+        std::string headHash = readHEAD();
+
+        auto headBlobs = readBlobsFromCommit(headHash);
+        auto branchBlobs = readBlobsFromCommit(branchHash);
+
+        // Merge: prefer branch version if duplicate
+        for (auto& entry : branchBlobs) {
+            headBlobs[entry.first] = entry.second;
+        }
+
+        // Create merge commit
+        std::string content = encodeCommit(time(NULL), "Merged branch '" + branchName + "'",
+                                           {headHash, branchHash},
+                                           {headBlobs.begin(), headBlobs.end()});
+        if (content.empty()) {
+            std::cerr << "? Malformed hash in merged commits, merge aborted.\n";
+            return;
+        }
+        newHash = simpleHash(content);
+
+        writeStoredFile(".minigit\\commits\\" + newHash, content);
+
+        // Update HEAD
+        result = advanceHEAD(headHash, newHash);
+    }
+
+    if (result != REF_UPDATED) {
+        std::cerr << "? Could not update HEAD: " << refUpdateFailure(result) << ".\n";
+        return;
+    }
+
+    std::cout << "? Simple merge complete: " << newHash << "\n";
+}
+
+std::map<std::string, std::string> threeWayMerge(
+    const std::map<std::string, std::string>& base,
+    const std::map<std::string, std::string>& current,
+    const std::map<std::string, std::string>& target)
+{
+    std::map<std::string, std::string> result;
+    std::set<std::string> allFiles;
+
+    // Collect all file names
+    for (auto& b : base) allFiles.insert(b.first);
+    for (auto& c : current) allFiles.insert(c.first);
+    for (auto& t : target) allFiles.insert(t.first);
+
+    for (auto& file : allFiles) {
+        std::string baseHash = base.count(file) ? base.at(file) : "";
+        std::string currentHash = current.count(file) ? current.at(file) : "";
+        std::string targetHash = target.count(file) ? target.at(file) : "";
+
+        if (currentHash == targetHash || baseHash == targetHash) {
+            result[file] = currentHash; // Unchanged or same as target
+        } else if (baseHash == currentHash) {
+            result[file] = targetHash; // Updated only in target
+        } else if (baseHash == targetHash) {
+            result[file] = currentHash; // Updated only in current
+        } else {
+            // Conflict: favor target side, or mark with a warning
+            std::cerr << "?? Conflict in file: " << file << " ? using target version\n";
+            result[file] = targetHash;
+        }
+    }
+    return result;
+}
+
+void threeWayMerge(const std::string& targetBranch) {
+    std::string targetHash = getBranchHash(targetBranch);
+    std::string newHash;
+    RefUpdate result = REF_STALE;
+
+    // Redo the merge on top of HEAD if another writer moved it meanwhile
+    for (int attempt = 0; attempt < REF_UPDATE_RETRIES && result == REF_STALE; ++attempt) {
+        std::string currentHash = readHEAD();
+        std::string baseHash = findLCA(currentHash, targetHash);
+
+        if (targetHash.empty() || baseHash.empty()) {
+            std::cerr << "? Missing target branch or base commit.\n";
+            return;
+        }
+
+        auto baseBlobs = readBlobsFromCommit(baseHash);
+        auto currBlobs = readBlobsFromCommit(currentHash);
+        auto targBlobs = readBlobsFromCommit(targetHash);
+
+        auto mergedBlobs = threeWayMerge(baseBlobs, currBlobs, targBlobs);
+
+        // Create merge commit
+        std::string content = encodeCommit(time(NULL), "3-way merge with branch '" + targetBranch + "'",
+                                           {currentHash, targetHash},
+                                           {mergedBlobs.begin(), mergedBlobs.end()});
+        if (content.empty()) {
+            std::cerr << "? Malformed hash in merged commits, merge aborted.\n";
+            return;
+        }
+        newHash = simpleHash(content);
+
+        writeStoredFile(".minigit\\commits\\" + newHash, content);
+
+        result = advanceHEAD(currentHash, newHash);
+    }
+
+    if (result != REF_UPDATED) {
+        std::cerr << "? Could not update HEAD: " << refUpdateFailure(result) << ".\n";
+        return;
+    }
+
+    std::cout << "? 3-way merge complete! New commit: " << newHash << "\n";
+}
+
+// ========== REMOTE SYNC ==========
+
+// Fetch and push move a bundle: one stream holding the commits the receiver
+// must already have ("prerequisite <hash>"), the refs being sent, and then
+// every object the receiver lacks, each as "object <kind> <hash> <size>"
+// followed by its bytes. Objects are ordered so that a commit follows its
+// blobs and its parents. The sender walks back from the wanted tips and stops
+// at the first commit the receiver already has (its advertised ref tips, or a
+// commit file it holds); since a stored commit always comes with its
+// ancestors, sync cost follows the new history rather than the repo size.
+
+const std::string BUNDLE_HEADER = "# minigit bundle v1";
+
+// Commit hashes the repository's refs point at.
+std::set<std::string> refFrontier(const std::string& gitDir) {
+    std::set<std::string> tips;
+    std::string head = readHEAD(gitDir);
+    if (!head.empty()) tips.insert(head);
+
+    for (auto& r : listRefs(gitDir)) tips.insert(r.second);
+    return tips;
+}
+
+bool isAncestor(const std::string& ancestor, const std::string& descendant, const std::string& gitDir) {
+    std::set<std::string> visited;
+    std::queue<std::string> q;
+    q.push(descendant);
+
+    while (!q.empty()) {
+        std::string current = q.front(); q.pop();
+        if (current == ancestor) return true;
+        if (!visited.insert(current).second) continue;
+        for (auto& p : readCommitParents(current, gitDir)) q.push(p);
+    }
+    return false;
+}
+
+// Commits reachable from `wants` that the receiver lacks, parents first.
+std::vector<std::string> negotiateMissingCommits(const std::string& srcDir,
+                                                 const std::vector<std::string>& wants,
+                                                 const std::function<bool(const std::string&)>& receiverHas) {
+    std::vector<std::string> order;
+    std::set<std::string> seen;
+    std::vector<std::pair<std::string, bool>> stack;
+    for (auto& w : wants) stack.push_back({w, false});
+
+    while (!stack.empty()) {
+        auto entry = stack.back(); stack.pop_back();
+        if (entry.second) {
+            order.push_back(entry.first);
+            continue;
+        }
+        if (!seen.insert(entry.first).second || receiverHas(entry.first)) continue;
+
+        stack.push_back({entry.first, true});
+        for (auto& p : readCommitParents(entry.first, srcDir))
+            stack.push_back({p, false});
+    }
+    return order;
+}
 
-        diffFiles(file, lines1, lines2);
+bool writeBundleObject(std::ostream& out, const std::string& kind, const std::string& hash,
+                       const std::string& path) {
+    if (!fileExists(path)) {
+        std::cerr << "? Missing " << kind << ": " << hash << "\n";
+        return false;
     }
+    std::string content = readStoredFile(path);
+
+    out << "object " << kind << " " << hash << " " << content.size() << "\n";
+    out.write(content.data(), content.size());
+    out << "\n";
+    return true;
 }
 
-// ========== LOG HISTORY ==========
+bool writeBundle(const std::string& bundlePath, const std::string& srcDir,
+                 const std::map<std::string, std::string>& refs,
+                 const std::function<bool(const std::string&)>& receiverHasCommit,
+                 const std::function<bool(const std::string&)>& receiverHasBlob) {
+    std::vector<std::string> wants;
+    for (auto& r : refs) wants.push_back(r.second);
+    auto commits = negotiateMissingCommits(srcDir, wants, receiverHasCommit);
+
+    std::ofstream out(bundlePath.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "? Cannot write bundle: " << bundlePath << "\n";
+        return false;
+    }
 
-void showLog(bool oneline = false) {
-    std::ifstream headFile(".minigit\\HEAD");
-    std::string commitHash;
+    // Parents the bundle stops at are the history the receiver must hold.
+    std::set<std::string> sent(commits.begin(), commits.end()), prerequisites;
+    for (const auto& commit : commits)
+        for (auto& p : readCommitParents(commit, srcDir))
+            if (!sent.count(p)) prerequisites.insert(p);
+
+    out << BUNDLE_HEADER << "\n";
+    for (auto& p : prerequisites) out << "prerequisite " << p << "\n";
+    for (auto& r : refs) out << "ref " << r.first << " " << r.second << "\n";
+
+    std::set<std::string> sentBlobs;
+    for (const auto& commit : commits) {
+        for (auto& b : readBlobsFromCommit(commit, srcDir)) {
+            if (sentBlobs.count(b.second) || receiverHasBlob(b.second)) continue;
+            if (!writeBundleObject(out, "blob", b.second, srcDir + "\\objects\\" + b.second))
+                return false;
+            sentBlobs.insert(b.second);
+        }
+        if (!writeBundleObject(out, "commit", commit, srcDir + "\\commits\\" + commit))
+            return false;
+    }
+    out << "end\n";
+    out.close();
 
-    if (!(headFile >> commitHash)) {
-        std::cout << "?? No commits found.\n";
+    std::cout << "?? Bundle: " << commits.size() << " commit(s), " << sentBlobs.size() << " blob(s).\n";
+    return true;
+}
+
+// The branch checked out in the receiving repository is never moved: its
+// working tree and index would silently fall behind, so the receiver has to
+// switch away from it first.
+void updateRefFastForward(const std::string& name, const std::string& newHash, const std::string& gitDir) {
+    if (headTarget(gitDir) == name) {
+        std::cerr << "? " << name << " is checked out in " << gitDir
+                  << ", refusing to update it (check out another branch there first).\n";
         return;
     }
 
-    while (commitHash != "none") {
-        std::string path = ".minigit\\commits\\" + commitHash;
-        std::ifstream commitFile(path.c_str());
+    RefUpdate result = REF_STALE;
+    for (int attempt = 0; attempt < REF_UPDATE_RETRIES && result == REF_STALE; ++attempt) {
+        std::string oldHash = lookupRef(name, gitDir);
+        if (oldHash == newHash) {
+            std::cout << "? " << name << " already up to date.\n";
+            return;
+        }
+        if (!oldHash.empty() && !isAncestor(oldHash, newHash, gitDir)) {
+            std::cerr << "? " << name << " rejected: " << newHash << " does not contain " << oldHash << "\n";
+            return;
+        }
+        result = updateRefWithRetry(name, oldHash, newHash, gitDir);
+    }
+
+    if (result == REF_UPDATED)
+        std::cout << "? " << name << " ? " << newHash << "\n";
+    else
+        std::cerr << "? Could not update " << name << ": " << refUpdateFailure(result) << ".\n";
+}
 
-        if (!commitFile) {
-            std::cerr << "? Commit file not found: " << commitHash << "\n";
+struct BundleObject {
+    std::string kind;
+    std::string hash;
+    std::streamoff offset;
+    size_t size;
+};
+
+// Reads the object whose bytes start at `offset` and checks it against its hash.
+bool readBundleObject(std::istream& in, const BundleObject& object, std::string& content) {
+    content.assign(object.size, '\0');
+    in.clear();
+    in.seekg(object.offset);
+    if (object.size > 0) in.read(&content[0], object.size);
+    return in && simpleHash(content) == object.hash;
+}
+
+// The bundle is checked in full before anything is stored: every object must
+// match its hash, and every parent, blob and ref target must either come with
+// the bundle or already be in the repository.
+bool importBundle(const std::string& bundlePath, const std::string& gitDir) {
+    std::ifstream in(bundlePath.c_str(), std::ios::binary);
+    std::string line;
+    if (!in || !getline(in, line) || line != BUNDLE_HEADER) {
+        std::cerr << "? Not a MiniGit bundle: " << bundlePath << "\n";
+        return false;
+    }
+    std::streamoff headerEnd = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streamoff total = in.tellg();
+    in.seekg(headerEnd);
+
+    std::vector<std::string> prerequisites;
+    std::vector<std::pair<std::string, std::string>> refs;
+    std::vector<BundleObject> objects;
+    std::set<std::string> bundledCommits, bundledBlobs;
+    std::vector<CommitRecord> commits;
+    bool complete = false;
+
+    while (getline(in, line)) {
+        if (line == "end") {
+            complete = true;
             break;
         }
 
-        std::string line, timestamp, message, parent;
+        std::istringstream fields(line);
+        std::string tag, kind, hash;
+        size_t size = 0;
+        fields >> tag;
 
-        // Parse lines to extract info
-        while (getline(commitFile, line)) {
-            if (line.find("timestamp:") == 0)
-                timestamp = extractField(line);
-            else if (line.find("message:") == 0)
-                message = extractField(line);
-            else if (line.find("parent:") == 0) {
-                parent = extractField(line);
-                break; // no need to read further
+        if (tag == "prerequisite") {
+            if (!(fields >> hash)) break;
+            prerequisites.push_back(hash);
+            continue;
+        }
+        if (tag == "ref") {
+            std::string name;
+            if (!(fields >> name >> hash)) break;
+            if (!isValidRefName(name)) {
+                std::cerr << "? Bundle carries an invalid ref name: " << name << "\n";
+                return false;
             }
+            refs.push_back({name, hash});
+            continue;
         }
+        if (tag != "object" || !(fields >> kind >> hash >> size)) break;
+        if (kind != "commit" && kind != "blob") break;
+        std::streamoff offset = in.tellg();
+        if (offset < 0 || size >= (uint64_t)(total - offset)) break;
+
+        BundleObject object = {kind, hash, offset, size};
+        std::string content;
+        if (!readBundleObject(in, object, content)) {
+            std::cerr << "? Corrupt " << kind << " in bundle: " << hash << "\n";
+            return false;
+        }
+        if (in.get() != '\n') break;
 
-        // Display based on mode
-        if (oneline) {
-            std::cout << commitHash << " - " << message << "\n";
+        if (kind == "commit") {
+            CommitRecord commit;
+            if (!parseCommit(content.data(), content.size(), commit, true)) {
+                std::cerr << "? Corrupt commit in bundle: " << hash << "\n";
+                return false;
+            }
+            commits.push_back(commit);
+            bundledCommits.insert(hash);
         } else {
-            std::cout << "?? Commit: " << commitHash << "\n";
-            std::cout << "?? " << timestamp << "\n";
-            std::cout << "?? " << message << "\n\n";
+            bundledBlobs.insert(hash);
         }
+        objects.push_back(object);
+    }
 
-        // Move to parent
-        commitHash = parent;
+    if (!complete) {
+        std::cerr << "? Bundle is truncated or malformed, nothing imported.\n";
+        return false;
     }
-}
 
-// ========== MERGE FUNCTIONALITY ==========
+    auto hasCommit = [&](const std::string& hash) {
+        return bundledCommits.count(hash) > 0 || fileExists(gitDir + "\\commits\\" + hash);
+    };
+    auto hasBlob = [&](const std::string& hash) {
+        return bundledBlobs.count(hash) > 0 || fileExists(gitDir + "\\objects\\" + hash);
+    };
+
+    std::vector<std::string> missing;
+    for (auto& p : prerequisites)
+        if (!hasCommit(p)) missing.push_back(p);
+    for (auto& commit : commits) {
+        for (auto& p : commit.parents)
+            if (!hasCommit(p)) missing.push_back(p);
+        for (auto& b : commit.blobs)
+            if (!hasBlob(b.second)) missing.push_back(b.second);
+    }
+    for (auto& r : refs)
+        if (!hasCommit(r.second)) missing.push_back(r.second);
+    if (!missing.empty()) {
+        std::cerr << "? Bundle needs " << missing.size() << " object(s) this repository lacks, e.g. "
+                  << missing.front() << "; nothing imported.\n";
+        return false;
+    }
 
-std::set<std::string> getAncestors(const std::string& root) {
-    std::set<std::string> visited;
-    std::queue<std::string> q;
-    q.push(root);
+    int stored = 0;
+    for (auto& object : objects) {
+        // Write under a temporary name so a partial object is never visible
+        std::string path = gitDir + (object.kind == "commit" ? "\\commits\\" : "\\objects\\") + object.hash;
+        if (fileExists(path)) continue;
 
-    while (!q.empty()) {
-        std::string current = q.front(); q.pop();
-        if (visited.count(current)) continue;
-        visited.insert(current);
+        std::string content;
+        if (!readBundleObject(in, object, content)) {
+            std::cerr << "? Bundle changed while importing: " << object.hash << "\n";
+            return false;
+        }
+        std::error_code ec;
+        if (writeStoredFile(path + ".tmp", content)) fs::rename(path + ".tmp", path, ec);
+        else ec = std::make_error_code(std::errc::io_error);
+        if (ec) {
+            std::remove((path + ".tmp").c_str());
+            std::cerr << "? Failed to store " << object.kind << ": " << object.hash << "\n";
+            return false;
+        }
+        ++stored;
+    }
 
-        std::ifstream commit(".minigit\\commits\\" + current);
-        if (!commit) continue;
+    std::cout << "?? Stored " << stored << " new object(s).\n";
+    for (auto& r : refs) updateRefFastForward(r.first, r.second, gitDir);
+    return true;
+}
 
-        std::string line;
-        while (getline(commit, line)) {
-            if (line.rfind("parent: ", 0) == 0) {
-                q.push(line.substr(8));
-            }
-            if (line.rfind("parent2: ", 0) == 0) {
-                q.push(line.substr(9));
-            }
-        }
+// Sends `branch` from srcDir to dstDir; both repositories are local.
+void syncBranch(const std::string& srcDir, const std::string& dstDir, const std::string& branch) {
+    if (!directoryExists(srcDir + "\\commits") || !directoryExists(dstDir + "\\commits")) {
+        std::cerr << "? Not a MiniGit repository: " << (directoryExists(srcDir + "\\commits") ? dstDir : srcDir) << "\n";
+        return;
     }
-    return visited;
+
+    std::string tip = lookupRef(branch, srcDir);
+    if (tip.empty()) {
+        std::cerr << "? Branch not found: " << branch << "\n";
+        return;
+    }
+
+    // The receiver advertises its ref tips; anything else is asked commit by
+    // commit as the sender reaches it.
+    std::set<std::string> frontier = refFrontier(dstDir);
+    auto hasCommit = [&](const std::string& hash) {
+        return frontier.count(hash) > 0 || fileExists(dstDir + "\\commits\\" + hash);
+    };
+    auto hasBlob = [&](const std::string& hash) {
+        return fileExists(dstDir + "\\objects\\" + hash);
+    };
+
+    std::string bundlePath = dstDir + "\\incoming.bundle";
+    if (writeBundle(bundlePath, srcDir, {{branch, tip}}, hasCommit, hasBlob))
+        importBundle(bundlePath, dstDir);
+    std::remove(bundlePath.c_str());
 }
 
-std::string findLCA(const std::string& h1, const std::string& h2) {
-    auto a1 = getAncestors(h1);
-    std::queue<std::string> q;
-    q.push(h2);
-    std::set<std::string> visited;
+void fetchFrom(const std::string& remotePath, const std::string& branch) {
+    syncBranch(remotePath + "\\.minigit", ".minigit", branch);
+}
 
-    while (!q.empty()) {
-        std::string current = q.front(); q.pop();
-        if (visited.count(current)) continue;
-        visited.insert(current);
-        if (a1.count(current)) return current;
+void pushTo(const std::string& remotePath, const std::string& branch) {
+    syncBranch(".minigit", remotePath + "\\.minigit", branch);
+}
 
-        std::ifstream file(".minigit\\commits\\" + current);
-        std::string line;
-        while (getline(file, line)) {
-            if (line.rfind("parent: ", 0) == 0) q.push(line.substr(8));
-            if (line.rfind("parent2: ", 0) == 0) q.push(line.substr(9));
-        }
+// `basis` lists commits the receiving side already has ("none" for a full
+// bundle); history behind them and the blobs they reference are left out.
+void exportBundle(const std::string& branch, const std::string& bundlePath, const std::string& basis) {
+    std::string tip = lookupRef(branch);
+    if (tip.empty()) {
+        std::cerr << "? Branch not found: " << branch << "\n";
+        return;
     }
-    return "";
+
+    std::set<std::string> basisCommits, basisBlobs;
+    std::istringstream list(basis);
+    std::string hash;
+    while (getline(list, hash, ',')) {
+        if (hash.empty() || hash == "none") continue;
+        basisCommits.insert(hash);
+        for (auto& b : readBlobsFromCommit(hash)) basisBlobs.insert(b.second);
+    }
+
+    auto hasCommit = [&](const std::string& h) { return basisCommits.count(h) > 0; };
+    auto hasBlob = [&](const std::string& h) { return basisBlobs.count(h) > 0; };
+
+    if (writeBundle(bundlePath, ".minigit", {{branch, tip}}, hasCommit, hasBlob))
+        std::cout << "? Bundle written: " << bundlePath << "\n";
 }
 
-void simpleMerge(const std::string& branchName) {
-    std::string headHash = readHEAD();
-    std::string branchHash = getBranchHash(branchName);
+// ========== INTEGRITY CHECK ==========
 
-    if (branchHash.empty()) {
-        std::cerr << "? Branch not found: " << branchName << "\n";
-        return;
+// fsck streams directory entries through a bounded queue to one worker per
+// core. Workers rehash each object and check that every commit's parents and
+// blobs exist, printing problems as they are found. Only the 64-bit values of
+// referenced hashes are kept, so memory follows the number of distinct
+// references, not the size of the store; a last pass over the directories
+// reports objects nothing refers to.
+
+template <typename T>
+struct BoundedQueue {
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return items.size() < capacity; });
+        items.push(std::move(item));
+        notEmpty.notify_one();
     }
 
-    auto headBlobs = readBlobsFromCommit(headHash);
-    auto branchBlobs = readBlobsFromCommit(branchHash);
+    // Returns false once the queue is closed and drained.
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop();
+        notFull.notify_one();
+        return true;
+    }
 
-    // Merge: prefer branch version if duplicate
-    for (auto& entry : branchBlobs) {
-        headBlobs[entry.first] = entry.second;
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
     }
 
-    // Create merge commit
-    std::ostringstream commitContent;
-    time_t now = time(NULL);
-    char buf[64];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+private:
+    size_t capacity;
+    bool closed = false;
+    std::queue<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty, notFull;
+};
+
+// Calls fn(workerIndex, filename) for every file in `dir` on workerCount()
+// threads. Returns the error that stopped the directory listing, if any.
+std::error_code forEachFileParallel(const std::string& dir,
+                                    const std::function<void(unsigned, const std::string&)>& fn) {
+    BoundedQueue<std::string> queue(4096);
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < workerCount(); ++w) {
+        workers.emplace_back([&, w] {
+            std::string name;
+            while (queue.pop(name)) fn(w, name);
+        });
+    }
 
-    commitContent << "timestamp: " << buf << "\n";
-    commitContent << "message: Merged branch '" << branchName << "'\n";
-    commitContent << "parent: " << headHash << "\n";
-    commitContent << "parent2: " << branchHash << "\n";
-    commitContent << "blobs:\n";
-    for (auto& pair : headBlobs) {
-        commitContent << "  " << pair.first << " " << pair.second << "\n";
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        std::error_code typeEc;
+        if (it->is_regular_file(typeEc)) queue.push(it->path().filename().string());
     }
+    queue.close();
+    for (auto& t : workers) t.join();
+    return ec;
+}
 
-    std::string content = commitContent.str();
-    std::string newHash = simpleHash(content);
+bool parseObjectName(const std::string& name, uint64_t& key) {
+    if (name.empty() || name.size() > 16 ||
+        name.find_first_not_of("0123456789abcdef") != std::string::npos)
+        return false;
+    key = std::strtoull(name.c_str(), NULL, 16);
+    return true;
+}
 
-    std::ofstream out(".minigit\\commits\\" + newHash);
-    out << content;
-    out.close();
+// Sorted, duplicate-free key sets; compacted as they grow so repeated
+// references do not pile up.
+void compactKeys(std::vector<uint64_t>& keys) {
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
 
-    // Update HEAD
-    std::ofstream headFile(".minigit\\HEAD");
-    headFile << newHash;
-    headFile.close();
+void addKey(std::vector<uint64_t>& keys, uint64_t key) {
+    keys.push_back(key);
+    if (keys.size() == keys.capacity() && keys.size() >= 1024) compactKeys(keys);
+}
 
-    std::cout << "? Simple merge complete: " << newHash << "\n";
+void runFsck() {
+    std::mutex outputMutex;
+    std::atomic<long> objects(0), commits(0), problems(0);
+    auto report = [&](const std::string& message) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cout << message << "\n";
+        ++problems;
+    };
+    // A store that cannot be listed is a problem in itself, and leaves the
+    // reference sets incomplete for the dangling pass.
+    bool listedAll = true;
+    auto reportListing = [&](const std::string& dir, const std::error_code& ec) {
+        if (!ec) return;
+        report("? Could not read " + dir + ": " + ec.message());
+        listedAll = false;
+    };
+
+    std::cout << "?? Checking objects on " << workerCount() << " thread(s)...\n";
+
+    std::error_code listing = forEachFileParallel(".minigit\\objects", [&](unsigned, const std::string& name) {
+        uint64_t key;
+        if (!parseObjectName(name, key)) {
+            report("?? Stray file in objects: " + name);
+            return;
+        }
+        std::string actual = simpleHash(readStoredFile(".minigit\\objects\\" + name));
+        if (actual != name)
+            report("? Corrupt blob " + name + " (content hashes to " + actual + ")");
+        ++objects;
+    });
+    reportListing(".minigit\\objects", listing);
+
+    std::vector<std::vector<uint64_t>> blobRefs(workerCount()), commitRefs(workerCount());
+
+    listing = forEachFileParallel(".minigit\\commits", [&](unsigned w, const std::string& name) {
+        uint64_t key;
+        if (!parseObjectName(name, key)) {
+            report("?? Stray file in commits: " + name);
+            return;
+        }
+        std::string content = readStoredFile(".minigit\\commits\\" + name);
+        std::string actual = simpleHash(content);
+        if (actual != name)
+            report("? Corrupt commit " + name + " (content hashes to " + actual + ")");
+        ++commits;
+
+        CommitRecord commit;
+        if (!parseCommit(content.data(), content.size(), commit, true)) {
+            report("? Malformed commit " + name);
+            return;
+        }
+
+        for (const auto& parent : commit.parents) {
+            if (!parseObjectName(parent, key)) {
+                report("? Commit " + name + " has malformed parent: " + parent);
+            } else {
+                addKey(commitRefs[w], key);
+                if (!fileExists(".minigit\\commits\\" + parent))
+                    report("? Commit " + name + " has missing parent: " + parent);
+            }
+        }
+        for (const auto& entry : commit.blobs) {
+            const std::string& blob = entry.second;
+            if (!parseObjectName(blob, key)) {
+                report("? Commit " + name + " lists malformed blob: " + blob);
+            } else if (!fileExists(".minigit\\objects\\" + blob)) {
+                report("? Commit " + name + " references missing blob: " + blob);
+            } else {
+                addKey(blobRefs[w], key);
+            }
+        }
+    });
+    reportListing(".minigit\\commits", listing);
+
+    std::vector<uint64_t> referencedBlobs, referencedCommits;
+    for (unsigned w = 0; w < workerCount(); ++w) {
+        referencedBlobs.insert(referencedBlobs.end(), blobRefs[w].begin(), blobRefs[w].end());
+        referencedCommits.insert(referencedCommits.end(), commitRefs[w].begin(), commitRefs[w].end());
+        std::vector<uint64_t>().swap(blobRefs[w]);
+        std::vector<uint64_t>().swap(commitRefs[w]);
+        compactKeys(referencedBlobs);
+        compactKeys(referencedCommits);
+    }
+
+    // Ref tips and staged blobs count as references too.
+    uint64_t key;
+    std::map<std::string, std::string> tips = listRefs(".minigit");
+    tips["HEAD"] = readHEAD();
+    for (auto& tip : tips) {
+        if (tip.second.empty()) continue;
+        if (!parseObjectName(tip.second, key) || !fileExists(".minigit\\commits\\" + tip.second))
+            report("? Ref " + tip.first + " points to missing commit: " + tip.second);
+        else
+            referencedCommits.push_back(key);
+    }
+    for (auto& staged : readIndex()) {
+        if (parseObjectName(staged.second, key)) referencedBlobs.push_back(key);
+    }
+    compactKeys(referencedBlobs);
+    compactKeys(referencedCommits);
+
+    long dangling = 0;
+    auto reportDangling = [&](const std::string& dir, const std::string& kind,
+                              const std::vector<uint64_t>& referenced) {
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            std::string name = it->path().filename().string();
+            if (parseObjectName(name, key) &&
+                !std::binary_search(referenced.begin(), referenced.end(), key)) {
+                std::cout << "?? Dangling " << kind << ": " << name << "\n";
+                ++dangling;
+            }
+        }
+        reportListing(dir, ec);
+    };
+    if (listedAll) {
+        reportDangling(".minigit\\commits", "commit", referencedCommits);
+        reportDangling(".minigit\\objects", "blob", referencedBlobs);
+    } else {
+        std::cout << "?? Skipping the dangling-object pass, the stores were not fully read.\n";
+    }
+
+    std::cout << "? fsck checked " << objects << " blob(s) and " << commits << " commit(s): "
+              << problems << " problem(s), " << dangling << " dangling object(s).\n";
 }
 
-std::map<std::string, std::string> threeWayMerge(
-    const std::map<std::string, std::string>& base,
-    const std::map<std::string, std::string>& current,
-    const std::map<std::string, std::string>& target)
-{
-    std::map<std::string, std::string> result;
-    std::set<std::string> allFiles;
+// ========== HISTORY SEARCH ==========
 
-    // Collect all file names
-    for (auto& b : base) allFiles.insert(b.first);
-    for (auto& c : current) allFiles.insert(c.first);
-    for (auto& t : target) allFiles.insert(t.first);
+// grep walks the requested commits, collects the distinct blobs they list and
+// scans each blob once, spread over all cores. A literal the pattern cannot
+// match without is looked up first with the C library's vectorized memmem, so
+// most blobs are rejected without looking at individual lines; regexes only
+// run on lines that contain that literal. Hits are then reported for every
+// (commit, path) that carried the blob.
 
-    for (auto& file : allFiles) {
-        std::string baseHash = base.count(file) ? base.at(file) : "";
-        std::string currentHash = current.count(file) ? current.at(file) : "";
-        std::string targetHash = target.count(file) ? target.at(file) : "";
+struct GrepHit {
+    size_t line;
+    std::string text;
+};
 
-        if (currentHash == targetHash || baseHash == targetHash) {
-            result[file] = currentHash; // Unchanged or same as target
-        } else if (baseHash == currentHash) {
-            result[file] = targetHash; // Updated only in target
-        } else if (baseHash == targetHash) {
-            result[file] = currentHash; // Updated only in current
+bool hasRegexSyntax(const std::string& pattern) {
+    return pattern.find_first_of(".^$|()[]{}*+?\\") != std::string::npos;
+}
+
+// Longest run of characters every match of `pattern` must contain, or "" if
+// none can be derived safely.
+std::string requiredLiteral(const std::string& pattern) {
+    if (pattern.find('|') != std::string::npos) return "";
+
+    std::string best, run;
+    auto flush = [&] {
+        if (run.size() > best.size()) best = run;
+        run.clear();
+    };
+
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+        bool optional = next == '*' || next == '?' || next == '{';
+
+        if (c == '\\' && i + 1 < pattern.size()) {
+            char escaped = pattern[++i];
+            next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+            optional = next == '*' || next == '?' || next == '{';
+            if (std::isalnum((unsigned char)escaped) || optional) {
+                flush();                    // class like \d, or quantified
+            } else {
+                run += escaped;
+            }
+        } else if (c == '[') {
+            flush();
+            size_t close = pattern.find(']', i + 2);
+            if (close == std::string::npos) return best;
+            i = close;
+        } else if (c == '(') {
+            flush();
+            int depth = 0;
+            for (; i < pattern.size(); ++i) {
+                if (pattern[i] == '\\') { ++i; continue; }
+                if (pattern[i] == '(') ++depth;
+                if (pattern[i] == ')' && --depth == 0) break;
+            }
+        } else if (c == '{') {
+            flush();                        // quantifier body is not text
+            size_t close = pattern.find('}', i);
+            if (close == std::string::npos) return best;
+            i = close;
+        } else if (std::strchr(".^$)]*+?", c)) {
+            flush();
+        } else if (optional) {
+            flush();
         } else {
-            // Conflict: favor target side, or mark with a warning
-            std::cerr << "?? Conflict in file: " << file << " ? using target version\n";
-            result[file] = targetHash;
+            run += c;
         }
     }
-    return result;
+    flush();
+    return best;
 }
 
-void threeWayMerge(const std::string& targetBranch) {
-    std::string currentHash = readHEAD();
-    std::string targetHash = getBranchHash(targetBranch);
-    std::string baseHash = findLCA(currentHash, targetHash);
+const char* findLiteral(const char* data, size_t size, const std::string& needle) {
+#ifdef __GLIBC__
+    return (const char*)memmem(data, size, needle.data(), needle.size());
+#else
+    const char* end = data + size;
+    const char* found = std::search(data, end,
+        std::boyer_moore_horspool_searcher<std::string::const_iterator>(needle.begin(), needle.end()));
+    return found == end ? nullptr : found;
+#endif
+}
 
-    if (targetHash.empty() || baseHash.empty()) {
-        std::cerr << "? Missing target branch or base commit.\n";
-        return;
+std::vector<GrepHit> grepBlob(const std::string& blobHash, const std::string& pattern,
+                              const std::string& literal, const std::regex* regex) {
+    std::vector<GrepHit> hits;
+    MappedFile blob(".minigit\\objects\\" + blobHash);
+    if (!blob.data) return hits;
+
+    const char* data = blob.data;
+    const char* end = data + blob.size;
+    if (!literal.empty() && !findLiteral(data, blob.size, literal)) return hits;
+
+    auto addLine = [&](const char* lineStart, const char* lineEnd, size_t lineNo) {
+        if (lineEnd > lineStart && lineEnd[-1] == '\r') --lineEnd;
+        hits.push_back({lineNo, std::string(lineStart, lineEnd)});
+    };
+
+    size_t lineNo = 1;
+    const char* lineStart = data;
+
+    if (!regex) {
+        // Jump from occurrence to occurrence, counting newlines in between.
+        const char* pos = data;
+        while (const char* found = findLiteral(pos, end - pos, pattern)) {
+            lineNo += std::count(lineStart, found, '\n');
+            while (const char* nl = (const char*)memchr(lineStart, '\n', found - lineStart))
+                lineStart = nl + 1;
+            const char* lineEnd = (const char*)memchr(found, '\n', end - found);
+            if (!lineEnd) lineEnd = end;
+            addLine(lineStart, lineEnd, lineNo);
+            if (lineEnd == end) break;
+            pos = lineStart = lineEnd + 1;
+            ++lineNo;
+        }
+        return hits;
     }
 
-    auto baseBlobs = readBlobsFromCommit(baseHash);
-    auto currBlobs = readBlobsFromCommit(currentHash);
-    auto targBlobs = readBlobsFromCommit(targetHash);
+    while (lineStart < end) {
+        const char* lineEnd = (const char*)memchr(lineStart, '\n', end - lineStart);
+        if (!lineEnd) lineEnd = end;
+        if ((literal.empty() || findLiteral(lineStart, lineEnd - lineStart, literal)) &&
+            std::regex_search(lineStart, lineEnd, *regex))
+            addLine(lineStart, lineEnd, lineNo);
+        lineStart = lineEnd + 1;
+        ++lineNo;
+    }
+    return hits;
+}
 
-    auto mergedBlobs = threeWayMerge(baseBlobs, currBlobs, targBlobs);
+// Commits in `range` ("A..B", a single ref/commit, or "" for HEAD), newest
+// first. Returns false if either end does not name a stored commit.
+bool commitsInRange(const std::string& range, std::vector<std::string>& commits) {
+    std::string from, to = range;
+    size_t dots = range.find("..");
+    if (dots != std::string::npos) {
+        from = range.substr(0, dots);
+        to = range.substr(dots + 2);
+    }
 
-    // Create merge commit
-    std::ostringstream commitContent;
-    time_t now = time(NULL);
-    char buf[64];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    std::string tip = resolveCommit(to.empty() ? "HEAD" : to);
+    std::set<std::string> excluded;
+    if (!from.empty()) {
+        std::string base = resolveCommit(from);
+        if (base.empty()) {
+            std::cerr << "? Unknown commit: " << from << "\n";
+            return false;
+        }
+        excluded = getAncestors(base);
+    }
+    if (tip.empty()) {
+        std::cerr << "? Unknown commit: " << (to.empty() ? "HEAD" : to) << "\n";
+        return false;
+    }
 
-    commitContent << "timestamp: " << buf << "\n";
-    commitContent << "message: 3-way merge with branch '" << targetBranch << "'\n";
-    commitContent << "parent: " << currentHash << "\n";
-    commitContent << "parent2: " << targetHash << "\n";
-    commitContent << "blobs:\n";
-    for (auto& b : mergedBlobs) {
-        commitContent << "  " << b.first << " " << b.second << "\n";
+    std::set<std::string> visited(excluded);
+    std::queue<std::string> q;
+    q.push(tip);
+    while (!q.empty()) {
+        std::string current = q.front(); q.pop();
+        if (!visited.insert(current).second) continue;
+        commits.push_back(current);
+        for (auto& parent : readCommitParents(current)) q.push(parent);
     }
+    return true;
+}
 
-    std::string content = commitContent.str();
-    std::string newHash = simpleHash(content);
+void grepHistory(const std::string& pattern, const std::string& range) {
+    if (pattern.empty()) {
+        std::cerr << "? Empty search pattern.\n";
+        return;
+    }
 
-    std::ofstream commitFile(".minigit\\commits\\" + newHash);
-    commitFile << content;
-    commitFile.close();
+    std::unique_ptr<std::regex> regex;
+    std::string literal = pattern;
+    if (hasRegexSyntax(pattern)) {
+        try {
+            regex.reset(new std::regex(pattern));
+        } catch (const std::regex_error& e) {
+            std::cerr << "? Invalid pattern: " << e.what() << "\n";
+            return;
+        }
+        literal = requiredLiteral(pattern);
+    }
 
-    std::ofstream head(".minigit\\HEAD");
-    head << newHash;
-    head.close();
+    // Each commit's files point into the list of distinct blobs
+    std::vector<std::string> commits;
+    if (!commitsInRange(range, commits)) return;
+    std::vector<std::vector<std::pair<std::string, size_t>>> commitFiles(commits.size());
+    std::map<std::string, size_t> blobIndex;
+    std::vector<std::string> blobs;
+
+    for (size_t c = 0; c < commits.size(); ++c) {
+        for (auto& b : readBlobsFromCommit(commits[c])) {
+            auto inserted = blobIndex.insert({b.second, blobs.size()});
+            if (inserted.second) blobs.push_back(b.second);
+            commitFiles[c].push_back({b.first, inserted.first->second});
+        }
+    }
 
-    std::cout << "? 3-way merge complete! New commit: " << newHash << "\n";
+    std::vector<std::vector<GrepHit>> hits(blobs.size());
+    unsigned threads = parallelFor(blobs.size(), [&](size_t i) {
+        hits[i] = grepBlob(blobs[i], pattern, literal, regex.get());
+    });
+
+    size_t matches = 0;
+    for (size_t c = 0; c < commits.size(); ++c) {
+        for (auto& file : commitFiles[c]) {
+            for (auto& hit : hits[file.second]) {
+                std::cout << commits[c] << ":" << file.first << ":" << hit.line << ": " << hit.text << "\n";
+                ++matches;
+            }
+        }
+    }
+
+    std::cout << "?? " << matches << " match(es); scanned " << blobs.size() << " unique blob(s) from "
+              << commits.size() << " commit(s) on " << threads << " thread(s).\n";
 }
 
 // ========== MAIN MENU ==========
@@ -669,7 +2806,12 @@ void showMainMenu() {
     std::cout << "5. Diff Viewer\n";
     std::cout << "6. Log History\n";
     std::cout << "7. Merge\n";
-    std::cout << "8. Exit\n";
+    std::cout << "8. Status\n";
+    std::cout << "9. Filesystem Monitor\n";
+    std::cout << "10. Remote Sync\n";
+    std::cout << "11. Integrity Check (fsck)\n";
+    std::cout << "12. Search History\n";
+    std::cout << "13. Exit\n";
     std::cout << "Choose option: ";
 }
 
@@ -677,14 +2819,33 @@ void showBlobMenu() {
     std::cout << "\nMiniGit Blob Storage\n";
     std::cout << "1. Store file as blob\n";
     std::cout << "2. Stage file for snapshot\n";
-    std::cout << "3. Back to main menu\n";
+    std::cout << "3. Stage all changed files\n";
+    std::cout << "4. Back to main menu\n";
     std::cout << "Choose option: ";
 }
 
 void showBranchMenu() {
     std::cout << "\nMiniGit Branch Management\n";
     std::cout << "1. Create branch/pointer\n";
-    std::cout << "2. Back to main menu\n";
+    std::cout << "2. Pack refs\n";
+    std::cout << "3. Back to main menu\n";
+    std::cout << "Choose option: ";
+}
+
+void showDiffMenu() {
+    std::cout << "\nMiniGit Diff Viewer\n";
+    std::cout << "1. Full diff\n";
+    std::cout << "2. Diff --stat\n";
+    std::cout << "3. Back to main menu\n";
+    std::cout << "Choose option: ";
+}
+
+void showLogMenu() {
+    std::cout << "\nMiniGit Log History\n";
+    std::cout << "1. Full log\n";
+    std::cout << "2. One-line log\n";
+    std::cout << "3. Log --stat\n";
+    std::cout << "4. Back to main menu\n";
     std::cout << "Choose option: ";
 }
 
@@ -692,10 +2853,30 @@ void showCheckoutMenu() {
     std::cout << "\nMiniGit Checkout\n";
     std::cout << "1. Checkout branch\n";
     std::cout << "2. Checkout commit\n";
+    std::cout << "3. Add sparse checkout pattern\n";
+    std::cout << "4. Disable sparse checkout\n";
+    std::cout << "5. Back to main menu\n";
+    std::cout << "Choose option: ";
+}
+
+void showMonitorMenu() {
+    std::cout << "\nMiniGit Filesystem Monitor\n";
+    std::cout << "1. Start watcher\n";
+    std::cout << "2. Stop watcher\n";
     std::cout << "3. Back to main menu\n";
     std::cout << "Choose option: ";
 }
 
+void showSyncMenu() {
+    std::cout << "\nMiniGit Remote Sync\n";
+    std::cout << "1. Fetch branch from repository\n";
+    std::cout << "2. Push branch to repository\n";
+    std::cout << "3. Export bundle\n";
+    std::cout << "4. Import bundle\n";
+    std::cout << "5. Back to main menu\n";
+    std::cout << "Choose option: ";
+}
+
 void showMergeMenu() {
     std::cout << "\nMiniGit Merge System\n";
     std::cout << "1. Simple merge (take branch changes)\n";
@@ -715,14 +2896,19 @@ int main() {
         showMainMenu();
         std::cin >> mainChoice;
 
-        if (mainChoice == 8) break;
+        if (mainChoice == 13) break;
 
         switch (mainChoice) {
             case 1: // Blob Storage
                 while (true) {
                     showBlobMenu();
                     std::cin >> subChoice;
-                    if (subChoice == 3) break;
+                    if (subChoice == 4) break;
+                    
+                    if (subChoice == 3) {
+                        stageChangedFiles();
+                        continue;
+                    }
                     
                     std::cout << "Enter filename: ";
                     std::cin >> filename;
@@ -741,12 +2927,14 @@ int main() {
                 while (true) {
                     showBranchMenu();
                     std::cin >> subChoice;
-                    if (subChoice == 2) break;
+                    if (subChoice == 3) break;
                     
                     if (subChoice == 1) {
                         std::cout << "Enter new branch/pointer name: ";
                         std::cin >> input;
                         createBranch(input);
+                    } else if (subChoice == 2) {
+                        packRefs();
                     } else {
                         std::cout << "Invalid option\n";
                     }
@@ -764,15 +2952,22 @@ int main() {
                 while (true) {
                     showCheckoutMenu();
                     std::cin >> subChoice;
-                    if (subChoice == 3) break;
+                    if (subChoice == 5) break;
+                    
+                    if (subChoice == 4) {
+                        disableSparseCheckout();
+                        continue;
+                    }
                     
-                    std::cout << "Enter target: ";
+                    std::cout << (subChoice == 3 ? "Enter path pattern: " : "Enter target: ");
                     std::cin >> input;
                     
                     if (subChoice == 1) {
                         checkoutBranch(input);
                     } else if (subChoice == 2) {
                         checkoutCommit(input);
+                    } else if (subChoice == 3) {
+                        addSparsePattern(input);
                     } else {
                         std::cout << "Invalid option\n";
                     }
@@ -780,11 +2975,37 @@ int main() {
                 break;
                 
             case 5: // Diff Viewer
-                showDiff();
+                while (true) {
+                    showDiffMenu();
+                    std::cin >> subChoice;
+                    if (subChoice == 3) break;
+                    
+                    if (subChoice == 1) {
+                        showDiff();
+                    } else if (subChoice == 2) {
+                        showDiffStat();
+                    } else {
+                        std::cout << "Invalid option\n";
+                    }
+                }
                 break;
                 
             case 6: // Log History
-                showLog();
+                while (true) {
+                    showLogMenu();
+                    std::cin >> subChoice;
+                    if (subChoice == 4) break;
+                    
+                    if (subChoice == 1) {
+                        showLog();
+                    } else if (subChoice == 2) {
+                        showLog(true);
+                    } else if (subChoice == 3) {
+                        showLogStat();
+                    } else {
+                        std::cout << "Invalid option\n";
+                    }
+                }
                 break;
                 
             case 7: // Merge
@@ -819,10 +3040,75 @@ int main() {
                 }
                 break;
                 
+            case 8: // Status
+                showStatus();
+                break;
+                
+            case 9: // Filesystem Monitor
+                while (true) {
+                    showMonitorMenu();
+                    std::cin >> subChoice;
+                    if (subChoice == 3) break;
+                    
+                    if (subChoice == 1) {
+                        startFsMonitor();
+                    } else if (subChoice == 2) {
+                        stopFsMonitor();
+                    } else {
+                        std::cout << "Invalid option\n";
+                    }
+                }
+                break;
+                
+            case 10: // Remote Sync
+                while (true) {
+                    showSyncMenu();
+                    std::cin >> subChoice;
+                    if (subChoice == 5) break;
+                    
+                    if (subChoice == 1 || subChoice == 2) {
+                        std::cout << "Enter repository path: ";
+                        std::cin >> input;
+                        std::cout << "Enter branch name: ";
+                        std::cin >> branch;
+                        if (subChoice == 1) fetchFrom(input, branch);
+                        else pushTo(input, branch);
+                    } else if (subChoice == 3) {
+                        std::cout << "Enter branch name: ";
+                        std::cin >> branch;
+                        std::cout << "Enter bundle file: ";
+                        std::cin >> filename;
+                        std::cout << "Enter commits the receiver has (comma-separated, or none): ";
+                        std::cin >> input;
+                        exportBundle(branch, filename, input);
+                    } else if (subChoice == 4) {
+                        std::cout << "Enter bundle file: ";
+                        std::cin >> filename;
+                        importBundle(filename, ".minigit");
+                    } else {
+                        std::cout << "Invalid option\n";
+                    }
+                }
+                break;
+                
+            case 11: // Integrity Check
+                runFsck();
+                break;
+                
+            case 12: // Search History
+                std::cout << "Enter search pattern: ";
+                std::cin.ignore();
+                std::getline(std::cin, input);
+                std::cout << "Enter commit range (A..B, commit, or blank for HEAD): ";
+                std::getline(std::cin, branch);
+                grepHistory(input, branch);
+                break;
+                
             default:
                 std::cout << "Invalid option\n";
         }
     }
 
+    if (fsMonitorThread.joinable()) stopFsMonitor();
     return 0;
 }